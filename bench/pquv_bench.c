@@ -0,0 +1,419 @@
+// Throughput and latency benchmark for pquv against a local PostgreSQL.
+//
+// Each scenario keeps `batch` queries outstanding: it queues a batch, waits
+// for all of its results and queues the next, until --queries have run.
+// Latency is measured per query from pquv_queue to its result callback.
+// Results are printed as CSV or JSON lines with stable columns, so runs from
+// different commits can be compared directly; pass --label to tag them.
+
+#include "pquv.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    const char *name;
+    int pool;     // Spread queries over --pool-size connections
+    int pipeline; // Pipeline window is the batch size
+    int binary;   // Binary parameter and result
+    int prepared; // Statement cache enabled
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    {"sequential-text", 0, 0, 0, 0},
+    {"sequential-binary", 0, 0, 1, 0},
+    {"sequential-prepared", 0, 0, 0, 1},
+    {"pipeline-text", 0, 1, 0, 0},
+    {"pipeline-binary", 0, 1, 1, 0},
+    {"pipeline-prepared", 0, 1, 0, 1},
+    {"pool-text", 1, 0, 0, 0},
+    {"pool-prepared", 1, 0, 0, 1},
+    {"pool-pipeline", 1, 1, 0, 1},
+};
+
+#define SCENARIO_COUNT ((int)(sizeof(scenarios) / sizeof(scenarios[0])))
+
+typedef struct bench bench_t;
+
+typedef struct
+{
+    bench_t *bench;
+    uint64_t start;
+} slot_t;
+
+struct bench
+{
+    uv_loop_t *loop;
+    const scenario_t *scenario;
+    pg_async_t *pg;
+    pquv_pool_t *pool;
+
+    int batch;
+    int total;
+    int issued;
+    int completed;
+    int outstanding;
+    int errors;
+    int failed; // Queueing itself failed, the run is aborted
+
+    slot_t *slots;
+    uint64_t *latency; // Nanoseconds, indexed like slots
+};
+
+typedef struct
+{
+    const char *conninfo;
+    const char *label;
+    const char *only;
+    const char *format;
+    int queries;
+    int warmup;
+    int pool_size;
+    int batches[16];
+    int batch_count;
+    int header;
+} options_t;
+
+static void issue_batch(bench_t *b);
+
+static void on_result(pg_async_t *pg, PGresult *result, void *data)
+{
+    (void)pg;
+    slot_t *slot = (slot_t *)data;
+    bench_t *b = slot->bench;
+
+    b->latency[slot - b->slots] = uv_hrtime() - slot->start;
+    if (pquv_query_status(pg) != PQUV_STATUS_OK || PQresultStatus(result) != PGRES_TUPLES_OK)
+    {
+        b->errors++;
+    }
+
+    b->completed++;
+    if (--b->outstanding > 0)
+        return;
+
+    if (b->issued < b->total)
+    {
+        issue_batch(b);
+    }
+    else
+    {
+        uv_stop(b->loop);
+    }
+}
+
+static void issue_batch(bench_t *b)
+{
+    static const char *text_params[] = {"42"};
+    static const Oid types[] = {PQUV_INT4OID};
+    static const int lengths[] = {4};
+    static const int formats[] = {1};
+    char binary[4];
+    pquv_put_int4(binary, 42);
+    const char *binary_params[] = {binary};
+
+    int count = b->total - b->issued < b->batch ? b->total - b->issued : b->batch;
+    for (int i = 0; i < count; i++)
+    {
+        slot_t *slot = &b->slots[b->issued];
+        slot->bench = b;
+        slot->start = uv_hrtime();
+
+        int rc;
+        if (b->pool)
+        {
+            rc = pquv_pool_queue(b->pool, "SELECT $1::int4", 1, text_params, on_result, slot);
+        }
+        else if (b->scenario->binary)
+        {
+            rc = pquv_queue_typed(b->pg, "SELECT $1::int4", 1, types, binary_params, lengths, formats, 1,
+                                  on_result, slot);
+        }
+        else
+        {
+            rc = pquv_queue(b->pg, "SELECT $1::int4", 1, text_params, on_result, slot);
+        }
+
+        if (rc != 0)
+        {
+            b->failed = 1;
+            uv_stop(b->loop);
+            return;
+        }
+        b->issued++;
+        b->outstanding++;
+    }
+}
+
+// Run `total` queries through the bench's context or pool
+static int run_phase(bench_t *b, int total)
+{
+    b->total = total;
+    b->issued = b->completed = b->outstanding = b->errors = 0;
+    if (total == 0)
+        return 0;
+
+    issue_batch(b);
+    if (!b->failed)
+    {
+        uv_run(b->loop, UV_RUN_DEFAULT);
+    }
+    return b->failed || b->completed != total ? -1 : 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_usec(const uint64_t *sorted, int count, int percentile)
+{
+    return sorted[(size_t)(count - 1) * percentile / 100] / 1000.0;
+}
+
+static int run_scenario(const options_t *opt, const scenario_t *scenario, int batch)
+{
+    bench_t b;
+    memset(&b, 0, sizeof(b));
+    b.loop = uv_default_loop();
+    b.scenario = scenario;
+    b.batch = batch;
+
+    int capacity = opt->queries > opt->warmup ? opt->queries : opt->warmup;
+    b.slots = calloc((size_t)capacity, sizeof(*b.slots));
+    b.latency = calloc((size_t)capacity, sizeof(*b.latency));
+    if (!b.slots || !b.latency)
+    {
+        fprintf(stderr, "pquv_bench: Out of memory\n");
+        free(b.slots);
+        free(b.latency);
+        return -1;
+    }
+
+    PGconn *conn = NULL;
+    if (scenario->pool)
+    {
+        b.pool = pquv_pool_create_ex(b.loop, opt->conninfo, opt->pool_size, NULL);
+        if (b.pool)
+        {
+            pquv_pool_set_pipeline(b.pool, scenario->pipeline ? batch : 0);
+            pquv_pool_set_statement_cache(b.pool, scenario->prepared ? 16 : 0);
+        }
+    }
+    else
+    {
+        conn = PQconnectdb(opt->conninfo);
+        if (PQstatus(conn) != CONNECTION_OK)
+        {
+            fprintf(stderr, "pquv_bench: Connection failed: %s", PQerrorMessage(conn));
+        }
+        else if ((b.pg = pquv_create_ex(b.loop, conn, NULL)) != NULL)
+        {
+            pquv_set_persistent(b.pg, 1);
+            pquv_set_pipeline(b.pg, scenario->pipeline ? batch : 0);
+            pquv_set_statement_cache(b.pg, scenario->prepared ? 16 : 0);
+        }
+    }
+
+    int rc = -1;
+    if ((b.pg || b.pool) && run_phase(&b, opt->warmup) == 0)
+    {
+        uint64_t began = uv_hrtime();
+        rc = run_phase(&b, opt->queries);
+        double seconds = (uv_hrtime() - began) / 1e9;
+
+        if (rc == 0)
+        {
+            qsort(b.latency, (size_t)opt->queries, sizeof(*b.latency), compare_u64);
+            double p50 = percentile_usec(b.latency, opt->queries, 50);
+            double p99 = percentile_usec(b.latency, opt->queries, 99);
+            double qps = opt->queries / seconds;
+
+            if (strcmp(opt->format, "json") == 0)
+            {
+                printf("{\"label\":\"%s\",\"scenario\":\"%s\",\"batch\":%d,\"queries\":%d,\"errors\":%d,"
+                       "\"seconds\":%.6f,\"qps\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+                       opt->label, scenario->name, batch, opt->queries, b.errors, seconds, qps, p50, p99);
+            }
+            else
+            {
+                printf("%s,%s,%d,%d,%d,%.6f,%.1f,%.1f,%.1f\n",
+                       opt->label, scenario->name, batch, opt->queries, b.errors, seconds, qps, p50, p99);
+            }
+            fflush(stdout);
+        }
+    }
+
+    if (rc != 0)
+    {
+        fprintf(stderr, "pquv_bench: %s with batch %d failed\n", scenario->name, batch);
+    }
+
+    // A standalone context borrows its connection, pooled ones are owned
+    if (b.pool)
+    {
+        pquv_pool_destroy(b.pool);
+    }
+    if (b.pg)
+    {
+        pquv_destroy(b.pg);
+    }
+    uv_run(b.loop, UV_RUN_DEFAULT);
+    PQfinish(conn);
+
+    free(b.slots);
+    free(b.latency);
+    return rc;
+}
+
+static void on_log(pquv_log_level_t level, const char *func, const char *message, void *data)
+{
+    (void)level;
+    (void)data;
+    fprintf(stderr, "pquv %s: %s\n", func, message);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: pquv_bench [options]\n"
+            "  --conninfo STR   libpq connection string (default $PQUV_BENCH_CONNINFO or dbname=postgres)\n"
+            "  --queries N      measured queries per run (default 20000)\n"
+            "  --warmup N       unmeasured queries before each run (default 1000)\n"
+            "  --batch A,B,...  outstanding queries per run (default 1,16,128)\n"
+            "  --pool-size N    connections for pool scenarios (default 4)\n"
+            "  --scenario NAME  run only this scenario\n"
+            "  --format FMT     csv or json (default csv)\n"
+            "  --label STR      first column of every row, e.g. a commit hash\n"
+            "  --no-header      omit the CSV header\n"
+            "  --list           print the scenario names\n");
+}
+
+static int parse_batches(options_t *opt, const char *list)
+{
+    opt->batch_count = 0;
+    const char *p = list;
+    while (*p && opt->batch_count < (int)(sizeof(opt->batches) / sizeof(opt->batches[0])))
+    {
+        char *end;
+        long value = strtol(p, &end, 10);
+        if (end == p || value <= 0)
+            return -1;
+
+        opt->batches[opt->batch_count++] = (int)value;
+        p = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',')
+            return -1;
+    }
+    return opt->batch_count > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    options_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.conninfo = getenv("PQUV_BENCH_CONNINFO") ? getenv("PQUV_BENCH_CONNINFO") : "dbname=postgres";
+    opt.label = "local";
+    opt.format = "csv";
+    opt.queries = 20000;
+    opt.warmup = 1000;
+    opt.pool_size = 4;
+    opt.header = 1;
+    parse_batches(&opt, "1,16,128");
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--no-header") == 0)
+        {
+            opt.header = 0;
+            continue;
+        }
+        if (strcmp(arg, "--list") == 0)
+        {
+            for (int s = 0; s < SCENARIO_COUNT; s++)
+            {
+                printf("%s\n", scenarios[s].name);
+            }
+            return 0;
+        }
+        if (!value)
+        {
+            usage();
+            return 2;
+        }
+        i++;
+
+        if (strcmp(arg, "--conninfo") == 0)
+            opt.conninfo = value;
+        else if (strcmp(arg, "--queries") == 0)
+            opt.queries = atoi(value);
+        else if (strcmp(arg, "--warmup") == 0)
+            opt.warmup = atoi(value);
+        else if (strcmp(arg, "--pool-size") == 0)
+            opt.pool_size = atoi(value);
+        else if (strcmp(arg, "--scenario") == 0)
+            opt.only = value;
+        else if (strcmp(arg, "--format") == 0)
+            opt.format = value;
+        else if (strcmp(arg, "--label") == 0)
+            opt.label = value;
+        else if (strcmp(arg, "--batch") == 0)
+        {
+            if (parse_batches(&opt, value) != 0)
+            {
+                usage();
+                return 2;
+            }
+        }
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    if (opt.queries <= 0 || opt.warmup < 0 || opt.pool_size <= 0 ||
+        (strcmp(opt.format, "csv") != 0 && strcmp(opt.format, "json") != 0))
+    {
+        usage();
+        return 2;
+    }
+
+    pquv_set_log(on_log, PQUV_LOG_WARN, NULL);
+
+    if (opt.header && strcmp(opt.format, "csv") == 0)
+    {
+        printf("label,scenario,batch,queries,errors,seconds,qps,p50_us,p99_us\n");
+    }
+
+    int failures = 0;
+    int matched = 0;
+    for (int s = 0; s < SCENARIO_COUNT; s++)
+    {
+        if (opt.only && strcmp(opt.only, scenarios[s].name) != 0)
+            continue;
+
+        matched = 1;
+        for (int i = 0; i < opt.batch_count; i++)
+        {
+            if (run_scenario(&opt, &scenarios[s], opt.batches[i]) != 0)
+            {
+                failures++;
+            }
+        }
+    }
+
+    if (!matched)
+    {
+        fprintf(stderr, "pquv_bench: Unknown scenario %s\n", opt.only);
+        return 2;
+    }
+
+    return failures ? 1 : 0;
+}
@@ -1,47 +1,420 @@
 #include "pquv.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// Internal helper functions
-#ifdef _WIN32
-static void on_timer(uv_timer_t *handle);
-static void on_timer_closed(uv_handle_t *handle);
+// Internal query flags
+#define QUERY_INTERNAL 0x01      // Issued by pquv itself, results are not delivered
+#define QUERY_PREPARE 0x02       // PQsendPrepare for owner's SQL
+#define QUERY_CACHE_CHECKED 0x04 // Already looked up in the statement cache
+#define QUERY_FAILED 0x08        // An internal step failed, results are suppressed
+#define QUERY_ARENA 0x10         // SQL and parameters live in the context's arena
+#define QUERY_DELIVERED 0x20     // result_cb has had a result, failures are not reported
+#define QUERY_TX 0x40            // Part of the transaction the context is pinned to
+#define QUERY_HEALTH 0x80        // pg_is_in_recovery() check of a pooled connection
+#define QUERY_CACHE_FILL 0x1000  // Its result goes into the context's cache
+
+// COPY states of a context
+#define COPY_NONE 0
+#define COPY_IN 1
+#define COPY_OUT 2
+
+// Write callbacks per poll event before other handles get a turn, and bytes
+// put between flushes that check for backpressure
+#define COPY_WRITE_BATCH 64
+#define COPY_FLUSH_BYTES 65536
+
+// Backoff for a pooled connection whose first connect failed and that has
+// no reconnect policy of its own
+#define POOL_RETRY_MIN_MS 100
+#define POOL_RETRY_MAX_MS 5000
+#define POOL_RETRY_ATTEMPTS 10
+
+// Query nodes are carved from slabs and recycled through a per-context free
+// list. Copied SQL and parameters are bump-allocated from arena blocks that
+// are recycled once the context has nothing queued or in flight; values too
+// large for a block, or beyond the arena limit, get their own heap block.
+#define QUERY_SLAB_SIZE 64
+#define ARENA_BLOCK_SIZE 16384
+#define ARENA_MAX_BLOCKS 64
+
+struct pquv_slab
+{
+    struct pquv_slab *next;
+    pg_query_t nodes[QUERY_SLAB_SIZE];
+};
+
+struct pquv_arena_block
+{
+    struct pquv_arena_block *next;
+    size_t used;
+    char data[ARENA_BLOCK_SIZE];
+};
+
+// NOTIFY subscription, notify_cb is NULL once removed during dispatch
+struct pquv_listener
+{
+    struct pquv_listener *next;
+    pquv_notify_cb_t notify_cb;
+    void *data;
+    char channel[]; // NUL-terminated
+};
+
+// A query submitted from another thread. The node is first so the release
+// callback can find the submission, SQL and parameters follow in the same
+// block.
+struct pquv_submission
+{
+    pg_query_t query;
+    struct pquv_submission *link; // In a submission or completion stack
+    pquv_mailbox_t *mailbox;
+    pquv_submit_cb_t submit_cb;
+    void *data;
+    PGresult *result;
+    pquv_status_t status;
+};
+
+// Submissions are pushed onto a lock-free stack by any thread and taken all
+// at once by the loop thread, so there is no ABA problem. It is freed once
+// both the pool and the async handle are gone.
+struct pquv_remote
+{
+    uv_async_t async;
+    _Atomic(struct pquv_submission *) head;
+    _Atomic int closed;      // Submissions are refused
+    _Atomic int submitters;  // Threads between checking closed and the wakeup
+    pquv_pool_t *pool;       // NULL once the pool is gone
+    int handle_closed;
+};
+
+struct pquv_mailbox
+{
+    uv_async_t async;
+    _Atomic(struct pquv_submission *) head;
+    int pending; // Submitted and not yet delivered, owned by the loop thread
+    int closing;
+};
+
+// Cached results are found through a hash table and evicted least recently
+// used first. The key is the SQL and each parameter, NUL-terminated, with a
+// marker byte before each parameter telling NULL from a value.
+#define CACHE_MIN_BUCKETS 64
+#define CACHE_MAX_BUCKETS 65536
+#define CACHE_PARAM_VALUE 1
+#define CACHE_PARAM_NULL 2
+
+struct pquv_cache_entry
+{
+    struct pquv_cache_entry *chain;      // Same bucket
+    struct pquv_cache_entry *prev, *next; // Most recently used first
+    uint64_t hash;
+    uint64_t expires; // uv_now() msec, 0 = never
+    size_t bytes;
+    PGresult *result;
+    size_t key_len;
+    char key[];
+};
+
+struct pquv_cache
+{
+    struct pquv_cache_entry **buckets;
+    size_t bucket_mask;
+    struct pquv_cache_entry *newest;
+    struct pquv_cache_entry *oldest;
+    size_t bytes;
+    size_t max_bytes;
+    unsigned int ttl_ms;
+};
+
+// A pool's health check timer, freed once closed
+struct pquv_health
+{
+    uv_timer_t timer;
+    unsigned int interval_ms;
+    pquv_pool_t *pool;
+};
+
+// A transaction on a pinned pooled connection
+struct pquv_tx
+{
+    pg_async_t *pg;      // NULL once the connection is gone
+    pg_query_t *begin;   // BEGIN until it completes
+    pg_query_t *end;     // COMMIT or ROLLBACK once queued
+    int held;            // Statements wait for commit or rollback
+    int failed;          // A statement failed, the transaction rolls back
+    int rolling_back;    // end is a ROLLBACK
+    pquv_status_t lost;  // The session ended, nothing more is sent
+    pquv_tx_cb_t done_cb;
+    void *data;
+};
+
+// A cancel request outlives its context if that is destroyed first
+struct pquv_cancel
+{
+    pg_async_t *pg; // NULL once detached
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    uv_poll_t poll;
+    PGcancelConn *conn;
+    int sock;
 #else
-static void on_poll(uv_poll_t *handle, int status, int events);
-static void on_poll_closed(uv_handle_t *handle);
+    uv_work_t work;
+    PGcancel *cancel;
 #endif
+};
+
+// Internal helper functions
+static void on_poll(uv_poll_t *handle, int status, int events);
+static int init_poll(pg_async_t *pg, int sock);
+static void on_connect_poll(uv_poll_t *handle, int status, int events);
+static int watch_connect(pg_async_t *pg, PostgresPollingStatusType poll_status);
+static void connect_done(pg_async_t *pg, int status);
+static pg_async_t *select_connection(pquv_pool_t *pool, int read_only);
+static int pool_executing(const pquv_pool_t *pool);
+static void on_health_timer(uv_timer_t *handle);
+static void queue_health_check(pg_async_t *pg, int front);
+static void health_result(pg_async_t *pg, PGresult *result);
+static void close_health(pquv_pool_t *pool);
+static void close_handle(pg_async_t *pg, uv_handle_t *handle);
+static void on_handle_closed(uv_handle_t *handle);
+static void close_poll(pg_async_t *pg);
+static void free_context(pg_async_t *pg);
+static void pool_forget(pg_async_t *pg);
+static int accepting_queries(pg_async_t *pg, const char *caller);
+static void shutdown_context(pg_async_t *pg, int graceful, unsigned int timeout_ms);
 
+static void *mem_alloc(size_t size);
+static void *mem_calloc(size_t count, size_t size);
+static char *mem_strdup(const char *str);
+static void mem_free(void *ptr);
+static pg_query_t *alloc_query(pg_async_t *pg);
+static void release_query(pg_async_t *pg, pg_query_t *query);
+static void *arena_alloc(pg_async_t *pg, size_t size);
+static void arena_reset(pg_async_t *pg);
+
+static pg_query_t *create_query(pg_async_t *pg,
+                                const char *sql,
+                                int param_count,
+                                const Oid *param_types,
+                                const char *const *param_values,
+                                const int *param_lengths,
+                                const int *param_formats,
+                                pg_result_cb_t result_cb,
+                                void *query_data);
+static int enqueue_query(pg_async_t *pg, pg_query_t *query);
+static int admit_query(pg_async_t *pg, pg_query_t *query);
+static void check_watermarks(pg_async_t *pg);
 static void execute_next_query(pg_async_t *pg);
-static void cleanup_query(pg_query_t *query);
+static void finish_execution(pg_async_t *pg);
+static pg_query_t *pop_query(pg_async_t *pg);
+static int send_query(pg_async_t *pg, pg_query_t *query);
+static int send_pipeline(pg_async_t *pg);
+static int prepare_statement(pg_async_t *pg);
+static void push_query(pg_async_t *pg, pg_query_t *query);
+static void forget_statement(pg_stmt_t *stmt);
+static void replace_statement_cache(pg_async_t *pg, pg_stmt_t *cache, int capacity);
+static unsigned long next_statement_id(void);
+static int process_results(pg_async_t *pg);
+static void begin_results(pg_async_t *pg);
+static int result_ok(ExecStatusType status);
+static int column_width(Oid type);
+static int fill_columns(pg_async_t *pg, pg_query_t *query, const PGresult *result);
+static int flush_output(pg_async_t *pg);
+static int watch_output(pg_async_t *pg);
+static int set_poll_events(pg_async_t *pg, int events);
+static void cleanup_query(pg_async_t *pg, pg_query_t *query);
+static int deliver(pg_async_t *pg, pg_result_cb_t cb, PGresult *result, void *data, pquv_status_t status);
+static void fail_query(pg_async_t *pg, pg_query_t *query, pquv_status_t status);
+static void fail_in_flight(pg_async_t *pg, pquv_status_t status);
+static void fail_queued(pg_async_t *pg, pquv_status_t status);
+static int start_reset(pg_async_t *pg);
+static int schedule_reconnect(pg_async_t *pg);
+static void connect_failed(pg_async_t *pg, int reconnect);
+static void replay_in_flight(pg_async_t *pg);
+static void connection_lost(pg_async_t *pg);
+static void reset_statements(pg_async_t *pg);
 static void handle_error(pg_async_t *pg, const char *error);
+static void arm_timer(pg_async_t *pg, uint64_t deadline);
+static void hold_for_coalesce(pg_async_t *pg);
+static void release_coalesced(pg_async_t *pg);
+static void on_coalesce(uv_check_t *handle);
+static void on_coalesce_spin(uv_idle_t *handle);
+static void on_timer(uv_timer_t *handle);
+static void start_cancel(pg_async_t *pg);
+static void cancel_done(struct pquv_cancel *request);
+static void drain_results(pg_async_t *pg);
 static void pg_async_destroy(pg_async_t *pg);
+static int pump_copy(pg_async_t *pg);
+static void reset_copy(pg_async_t *pg);
+static int copy_buf_reserve(pquv_copy_buf_t *buf, size_t extra);
+static int queue_listen(pg_async_t *pg, const char *command, const char *channel, int front);
+static void dispatch_notifies(pg_async_t *pg);
+static void push_submission(_Atomic(struct pquv_submission *) *head, struct pquv_submission *sub);
+static struct pquv_submission *take_submissions(_Atomic(struct pquv_submission *) *head);
+static void on_submit(uv_async_t *handle);
+static void on_mailbox(uv_async_t *handle);
+static void drain_submissions(pquv_pool_t *pool, pquv_status_t status);
+static void complete_submission(struct pquv_submission *sub);
+static void close_remote(pquv_pool_t *pool, pquv_status_t status);
+static void free_pool(pquv_pool_t *pool);
+static void sweep_listeners(pg_async_t *pg);
+static pg_query_t *queue_tx_query(pquv_tx_t *tx, const char *sql, int param_count, const char **params,
+                                  pg_result_cb_t result_cb, void *query_data);
+static void release_tx_hold(pquv_tx_t *tx);
+static void drop_tx_queries(pg_async_t *pg, pquv_status_t status, pg_query_t *keep);
+static int tx_held(const pg_async_t *pg);
+static void tx_step(pg_async_t *pg, pg_query_t *query);
+static void tx_lost(pg_async_t *pg, pquv_status_t status);
+static void finish_tx(pquv_tx_t *tx, pquv_status_t status);
+static uint64_t cache_hash(const char *sql, int param_count, const char *const *params, size_t *key_len);
+static struct pquv_cache_entry *cache_lookup(pquv_cache_t *cache, uv_loop_t *loop, const char *sql, int param_count,
+                                             const char *const *params);
+static void cache_store(pg_async_t *pg, const pg_query_t *query, const PGresult *result);
+static void cache_remove(pquv_cache_t *cache, struct pquv_cache_entry *entry);
+static void on_cache_notify(pg_async_t *pg, const char *channel, const char *payload, int be_pid, void *data);
+static void hist_record(pquv_histogram_t *hist, uint64_t start, uint64_t end);
+static void hist_merge(pquv_histogram_t *into, const pquv_histogram_t *from);
+static void trace_query(pg_async_t *pg, const pg_query_t *query, pquv_trace_event_t event, uint64_t time);
+
+// Diagnostics go to the installed callback. The level checks come before
+// any argument is evaluated, so a filtered message costs a branch, and the
+// constant PQUV_LOG_LEVEL check lets the compiler drop those below it.
+static pquv_log_cb_t log_cb = NULL;
+static pquv_log_level_t log_min_level = PQUV_LOG_WARN;
+static void *log_data = NULL;
+
+#define LOG_ENABLED(level) ((int)(level) >= PQUV_LOG_LEVEL && log_cb && (level) >= log_min_level)
+#define PQUV_LOG(level, ...)                                 \
+    do                                                       \
+    {                                                        \
+        if (LOG_ENABLED(level))                              \
+            log_message((level), __func__, __VA_ARGS__);     \
+    } while (0)
+#define LOG_DEBUG(...) PQUV_LOG(PQUV_LOG_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) PQUV_LOG(PQUV_LOG_INFO, __VA_ARGS__)
+#define LOG_WARN(...) PQUV_LOG(PQUV_LOG_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) PQUV_LOG(PQUV_LOG_ERROR, __VA_ARGS__)
+
+void pquv_set_log(pquv_log_cb_t cb, pquv_log_level_t min_level, void *data)
+{
+    log_cb = cb;
+    log_min_level = min_level;
+    log_data = data;
+}
+
+// Format into a stack buffer, longer messages are truncated
+static void log_message(pquv_log_level_t level, const char *func, const char *format, ...)
+{
+    char message[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    // libpq error messages end in a newline
+    if (len > 0 && (size_t)len < sizeof(message) && message[len - 1] == '\n')
+    {
+        message[len - 1] = '\0';
+    }
+    log_cb(level, func, message, log_data);
+}
+
+// Allocator used for everything pquv allocates itself
+static void *(*malloc_hook)(size_t) = malloc;
+static void (*free_hook)(void *) = free;
+
+void pquv_set_allocator(void *(*malloc_fn)(size_t), void (*free_fn)(void *))
+{
+    malloc_hook = malloc_fn ? malloc_fn : malloc;
+    free_hook = free_fn ? free_fn : free;
+}
+
+static void *mem_alloc(size_t size)
+{
+    return malloc_hook(size);
+}
+
+static void *mem_calloc(size_t count, size_t size)
+{
+    if (size && count > SIZE_MAX / size)
+        return NULL;
+
+    void *ptr = malloc_hook(count * size);
+    if (ptr)
+    {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+static char *mem_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = malloc_hook(len);
+    if (copy)
+    {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+static void mem_free(void *ptr)
+{
+    if (ptr)
+    {
+        free_hook(ptr);
+    }
+}
 
-// Create new async PostgreSQL context
+// Create new async PostgreSQL context on the default loop
 pg_async_t *pquv_create(PGconn *existing_conn, void *data)
 {
+    return pquv_create_ex(uv_default_loop(), existing_conn, data);
+}
+
+// Create new async PostgreSQL context on the given loop
+pg_async_t *pquv_create_ex(uv_loop_t *loop, PGconn *existing_conn, void *data)
+{
+    if (!loop)
+    {
+        LOG_ERROR("loop is NULL");
+        return NULL;
+    }
+
     if (!existing_conn)
     {
-        printf("pquv_create: existing_conn is NULL\n");
+        LOG_ERROR("existing_conn is NULL");
         return NULL;
     }
 
     if (PQstatus(existing_conn) != CONNECTION_OK)
     {
-        printf("pquv_create: Connection status is not OK: %d\n", PQstatus(existing_conn));
+        LOG_ERROR("Connection status is not OK: %d", PQstatus(existing_conn));
         return NULL;
     }
 
-    pg_async_t *pg = calloc(1, sizeof(pg_async_t));
+    pg_async_t *pg = mem_calloc(1, sizeof(pg_async_t));
     if (!pg)
     {
-        printf("pquv_create: Failed to allocate memory\n");
+        LOG_ERROR("Failed to allocate memory");
         return NULL;
     }
 
     // Use existing connection
     pg->conn = existing_conn;
     pg->owns_connection = 0;
+    pg->loop = loop;
+
+    // Sends must never block the loop; restored on destroy for borrowed connections
+    pg->was_nonblocking = PQisnonblocking(existing_conn);
+    if (PQsetnonblocking(existing_conn, 1) != 0)
+    {
+        LOG_ERROR("PQsetnonblocking failed: %s", PQerrorMessage(existing_conn));
+        mem_free(pg);
+        return NULL;
+    }
 
     // Setup callbacks and user data
     pg->data = data;
@@ -49,13 +422,55 @@ pg_async_t *pquv_create(PGconn *existing_conn, void *data)
     pg->handle_initialized = 0;
 
     // Initialize appropriate handle based on platform
-#ifdef _WIN32
-    memset(&pg->timer, 0, sizeof(pg->timer));
-    pg->timer.data = pg;
-#else
     memset(&pg->poll, 0, sizeof(pg->poll));
     pg->poll.data = pg;
-#endif
+
+    return pg;
+}
+
+// Start a non-blocking connection, connect_cb runs once it is ready or has failed
+pg_async_t *pquv_connect(uv_loop_t *loop,
+                         const char *conninfo,
+                         pg_connect_cb_t connect_cb,
+                         void *data)
+{
+    if (!loop || !conninfo)
+    {
+        LOG_ERROR("Invalid parameters");
+        return NULL;
+    }
+
+    PGconn *conn = PQconnectStart(conninfo);
+    if (!conn || PQstatus(conn) == CONNECTION_BAD)
+    {
+        LOG_ERROR("PQconnectStart failed: %s", conn ? PQerrorMessage(conn) : "out of memory");
+        PQfinish(conn);
+        return NULL;
+    }
+
+    pg_async_t *pg = mem_calloc(1, sizeof(pg_async_t));
+    if (!pg)
+    {
+        LOG_ERROR("Failed to allocate memory");
+        PQfinish(conn);
+        return NULL;
+    }
+
+    pg->conn = conn;
+    pg->owns_connection = 1;
+    pg->loop = loop;
+    pg->data = data;
+    pg->connect_cb = connect_cb;
+    pg->is_connecting = 1;
+    pg->poll.data = pg;
+
+    // libpq asks callers to start as if PQconnectPoll returned PGRES_POLLING_WRITING
+    if (watch_connect(pg, PGRES_POLLING_WRITING) != 0)
+    {
+        pg->is_connecting = 0;
+        pg_async_destroy(pg);
+        return NULL;
+    }
 
     return pg;
 }
@@ -70,549 +485,5613 @@ int pquv_queue(pg_async_t *pg,
 {
     if (!pg || !sql)
     {
-        printf("pquv_queue: Invalid parameters\n");
+        LOG_ERROR("Invalid parameters");
         return -1;
     }
 
-    pg_query_t *query = calloc(1, sizeof(pg_query_t));
-    if (!query)
+    if (accepting_queries(pg, "pquv_queue") != 0)
     {
-        printf("pquv_queue: Failed to allocate query\n");
         return -1;
     }
 
-    // Copy SQL
-    query->sql = strdup(sql);
-    if (!query->sql)
+    pg_query_t *query = create_query(pg, sql, param_count, NULL, (const char *const *)params,
+                                     NULL, NULL, result_cb, query_data);
+    if (!query)
     {
-        printf("pquv_queue: Failed to copy SQL\n");
-        free(query);
         return -1;
     }
 
-    // Copy parameters if any
-    if (param_count > 0 && params)
-    {
-        query->params = malloc(param_count * sizeof(char *));
-        if (!query->params)
-        {
-            printf("pquv_queue: Failed to allocate params\n");
-            free(query->sql);
-            free(query);
-            return -1;
-        }
+    return enqueue_query(pg, query);
+}
 
-        for (int i = 0; i < param_count; i++)
-        {
-            query->params[i] = params[i] ? strdup(params[i]) : NULL;
-        }
+// Add a query that may be resent after the connection was lost
+int pquv_queue_idempotent(pg_async_t *pg,
+                          const char *sql,
+                          int param_count,
+                          const char **params,
+                          pg_result_cb_t result_cb,
+                          void *query_data)
+{
+    if (!pg || !sql)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
     }
 
-    query->param_count = param_count;
-    query->result_cb = result_cb;
-    query->data = query_data;
-
-    // Add to queue
-    if (!pg->query_queue)
+    if (accepting_queries(pg, "pquv_queue_idempotent") != 0)
     {
-        pg->query_queue = pg->query_queue_tail = query;
+        return -1;
     }
-    else
+
+    pg_query_t *query = create_query(pg, sql, param_count, NULL, (const char *const *)params,
+                                     NULL, NULL, result_cb, query_data);
+    if (!query)
     {
-        pg->query_queue_tail->next = query;
-        pg->query_queue_tail = query;
+        return -1;
     }
 
-    return 0;
+    query->flags |= PQUV_QUERY_IDEMPOTENT;
+    return enqueue_query(pg, query);
 }
 
-// Start executing queued queries
-int pquv_execute(pg_async_t *pg)
+// Add a query whose rows are streamed to row_cb as they arrive
+int pquv_queue_rows(pg_async_t *pg,
+                    const char *sql,
+                    int param_count,
+                    const char **params,
+                    int chunk_size,
+                    pg_result_cb_t row_cb,
+                    pg_result_cb_t result_cb,
+                    void *query_data)
 {
-    if (!pg)
+    if (!pg || !sql || chunk_size <= 0)
     {
-        printf("pquv_execute: pg is NULL\n");
+        LOG_ERROR("Invalid parameters");
         return -1;
     }
 
-    if (!pg->is_connected)
+    if (accepting_queries(pg, "pquv_queue_rows") != 0)
     {
-        printf("pquv_execute: Not connected\n");
         return -1;
     }
 
-    if (pg->is_executing)
+    pg_query_t *query = create_query(pg, sql, param_count, NULL, (const char *const *)params,
+                                     NULL, NULL, result_cb, query_data);
+    if (!query)
     {
-        printf("pquv_execute: Already executing\n");
         return -1;
     }
 
-    if (!pg->query_queue)
-    {
-        // Always auto-cleanup when no queries remain
-        pg_async_destroy(pg);
-        return 0;
-    }
+    query->row_cb = row_cb;
+    query->chunk_size = chunk_size;
 
-    pg->is_executing = 1;
-    execute_next_query(pg);
-    return 0;
+    return enqueue_query(pg, query);
 }
 
-// Cancel current operations and cleanup
-static void pg_async_cancel(pg_async_t *pg)
+// Add a query whose binary rows are decoded into the caller's columns
+int pquv_queue_columns(pg_async_t *pg,
+                       const char *sql,
+                       int param_count,
+                       const char **params,
+                       pquv_columns_t *batch,
+                       pquv_batch_cb_t batch_cb,
+                       pg_result_cb_t result_cb,
+                       void *query_data)
 {
-    if (!pg)
-        return;
+    if (!pg || !sql || !batch || !batch_cb || !batch->columns || batch->column_count <= 0 || batch->capacity <= 0)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
 
-    if (pg->is_executing && pg->handle_initialized)
+    for (int i = 0; i < batch->column_count; i++)
     {
-#ifdef _WIN32
-        uv_timer_stop(&pg->timer);
-        if (!uv_is_closing((uv_handle_t *)&pg->timer))
+        pquv_column_t *column = &batch->columns[i];
+        int width = column_width(column->type);
+        if (width < 0 || (width > 0 && !column->values) || (width == 0 && (!column->data || !column->offsets)))
         {
-            uv_close((uv_handle_t *)&pg->timer, on_timer_closed);
+            LOG_ERROR("Column %d has an unsupported type %u or no buffer", i, column->type);
+            return -1;
         }
-#else
-        uv_poll_stop(&pg->poll);
-        if (!uv_is_closing((uv_handle_t *)&pg->poll))
+        if (width == 0)
         {
-            uv_close((uv_handle_t *)&pg->poll, on_poll_closed);
+            column->offsets[0] = 0;
         }
-#endif
-        pg->handle_initialized = 0;
     }
 
-    // Get cancel struct and send cancel request
-    if (pg->conn && pg->is_executing)
+    if (accepting_queries(pg, "pquv_queue_columns") != 0)
     {
-        PGcancel *cancel = PQgetCancel(pg->conn);
-        if (cancel)
-        {
-            char errbuf[256];
-            PQcancel(cancel, errbuf, sizeof(errbuf));
-            PQfreeCancel(cancel);
-        }
+        return -1;
     }
 
-    pg->is_executing = 0;
-
-    // Clear query queue
-    pg_query_t *query = pg->query_queue;
-    while (query)
+    pg_query_t *query = create_query(pg, sql, param_count, NULL, (const char *const *)params,
+                                     NULL, NULL, result_cb, query_data);
+    if (!query)
     {
-        pg_query_t *next = query->next;
-        cleanup_query(query);
-        query = next;
+        return -1;
     }
-    pg->query_queue = pg->query_queue_tail = NULL;
-}
 
-// Destroy context and free resources
-static void pg_async_destroy(pg_async_t *pg)
-{
-    if (!pg)
-        return;
+    // Chunks the size of a batch are decoded and freed one at a time
+    batch->rows = 0;
+    query->result_format = 1;
+    query->chunk_size = batch->capacity;
+    query->columns = batch;
+    query->batch_cb = batch_cb;
 
-    pg_async_cancel(pg);
+    return enqueue_query(pg, query);
+}
 
-    // If handle is initialized, close it
-    if (pg->handle_initialized)
-    {
-#ifdef _WIN32
-        if (!uv_is_closing((uv_handle_t *)&pg->timer))
-        {
-            uv_close((uv_handle_t *)&pg->timer, on_timer_closed);
-        }
-#else
-        if (!uv_is_closing((uv_handle_t *)&pg->poll))
-        {
-            uv_close((uv_handle_t *)&pg->poll, on_poll_closed);
-        }
-#endif
-    }
-    else
+// COPY runs on the simple query protocol, which pipeline mode does not allow
+static pg_query_t *create_copy_query(pg_async_t *pg, const char *sql, pg_result_cb_t result_cb, void *query_data)
+{
+    if (pg->pipeline_window > 0)
     {
-        // No handle initialized, clean up directly
-        if (pg->conn && pg->owns_connection)
-        {
-            PQfinish(pg->conn);
-        }
-        if (pg->error_message)
-        {
-            free(pg->error_message);
-        }
-        free(pg);
+        LOG_ERROR("COPY is not supported in pipeline mode");
+        return NULL;
     }
+
+    return create_query(pg, sql, 0, NULL, NULL, NULL, NULL, result_cb, query_data);
 }
 
-// Handle close callbacks
-#ifdef _WIN32
-static void on_timer_closed(uv_handle_t *handle)
+int pquv_queue_copy_in(pg_async_t *pg,
+                       const char *sql,
+                       pquv_copy_write_cb_t write_cb,
+                       pg_result_cb_t result_cb,
+                       void *query_data)
 {
-    if (!handle || !handle->data)
-        return;
-
-    pg_async_t *pg = (pg_async_t *)handle->data;
+    if (!pg || !sql || !write_cb)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
 
-    // Final cleanup
-    if (pg->conn && pg->owns_connection)
+    if (accepting_queries(pg, "pquv_queue_copy_in") != 0)
     {
-        PQfinish(pg->conn);
+        return -1;
     }
-    if (pg->error_message)
+
+    pg_query_t *query = create_copy_query(pg, sql, result_cb, query_data);
+    if (!query)
     {
-        free(pg->error_message);
+        return -1;
     }
-    free(pg);
+
+    query->copy_write_cb = write_cb;
+    return enqueue_query(pg, query);
 }
-#else
-static void on_poll_closed(uv_handle_t *handle)
-{
-    if (!handle || !handle->data)
-        return;
 
-    pg_async_t *pg = (pg_async_t *)handle->data;
+int pquv_queue_copy_out(pg_async_t *pg,
+                        const char *sql,
+                        pquv_copy_data_cb_t data_cb,
+                        pg_result_cb_t result_cb,
+                        void *query_data)
+{
+    if (!pg || !sql || !data_cb)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
 
-    // Final cleanup
-    if (pg->conn && pg->owns_connection)
+    if (accepting_queries(pg, "pquv_queue_copy_out") != 0)
     {
-        PQfinish(pg->conn);
+        return -1;
     }
-    if (pg->error_message)
+
+    pg_query_t *query = create_copy_query(pg, sql, result_cb, query_data);
+    if (!query)
     {
-        free(pg->error_message);
+        return -1;
     }
-    free(pg);
+
+    query->copy_data_cb = data_cb;
+    return enqueue_query(pg, query);
 }
-#endif
 
-// Execute the next query in the queue
-static void execute_next_query(pg_async_t *pg)
+int pquv_copy_put(pg_async_t *pg, const char *buf, int len)
 {
-    if (!pg->query_queue)
+    if (!pg || !buf || len < 0 || pg->copy_state != COPY_IN || pg->copy_ending)
     {
-        // All queries completed successfully
-        pg->is_executing = 0;
+        LOG_ERROR("No COPY FROM STDIN in progress");
+        return -1;
+    }
 
-        // Always auto-cleanup when all queries are done
-        pg_async_destroy(pg);
-        return;
+    // It timed out, or the connection is being torn down
+    pg_query_t *query = pg->current_query;
+    if (!query || (query->flags & QUERY_FAILED))
+    {
+        pquv_copy_end(pg, "COPY cancelled");
+        return -1;
     }
 
-    // Check if we're being shut down
-    extern int shutdown_requested;
-    if (shutdown_requested)
+    if (PQputCopyData(pg->conn, buf, len) != 1)
     {
-        pg->is_executing = 0;
-        pg_async_destroy(pg);
-        return;
+        LOG_WARN("PQputCopyData failed: %s", PQerrorMessage(pg->conn));
+        return -1;
     }
+    pg->copy_produced = 1;
 
-    pg->current_query = pg->query_queue;
-    pg->query_queue = pg->query_queue->next;
-    if (!pg->query_queue)
+    // libpq sends full 8 KiB blocks on its own, a flush now and then tells
+    // whether the socket keeps up
+    pg->copy_unflushed += (size_t)len;
+    if (pg->copy_unflushed < COPY_FLUSH_BYTES)
     {
-        pg->query_queue_tail = NULL;
+        return 0;
     }
+    pg->copy_unflushed = 0;
 
-    // Send query asynchronously
-    int result;
-    if (pg->current_query->param_count > 0)
+    if (flush_output(pg) != 0)
     {
-        result = PQsendQueryParams(pg->conn,
-                                   pg->current_query->sql,
-                                   pg->current_query->param_count,
-                                   NULL, // param types
-                                   (const char **)pg->current_query->params,
-                                   NULL, // param lengths
-                                   NULL, // param formats
-                                   0);   // result format (text)
+        return -1;
     }
-    else
+    if (pg->flushing)
     {
-        result = PQsendQuery(pg->conn, pg->current_query->sql);
+        // on_poll flushes the rest and asks for more data once it is out
+        set_poll_events(pg, UV_READABLE | UV_WRITABLE);
+        return 1;
     }
+    return 0;
+}
 
-    if (!result)
+int pquv_copy_end(pg_async_t *pg, const char *error)
+{
+    if (!pg || pg->copy_state != COPY_IN || pg->copy_ending)
     {
-        printf("execute_next_query: Failed to send query: %s\n", PQerrorMessage(pg->conn));
-        handle_error(pg, PQerrorMessage(pg->conn));
-        return;
+        LOG_ERROR("No COPY FROM STDIN in progress");
+        return -1;
     }
 
-#ifdef _WIN32
-    if (!pg->handle_initialized)
+    snprintf(pg->copy_error, sizeof(pg->copy_error), "%s", error ? error : "");
+    pg->copy_ending = 1;
+
+    // PQputCopyEnd runs from on_poll, which fires as soon as the socket is writable
+    set_poll_events(pg, UV_READABLE | UV_WRITABLE);
+    return 0;
+}
+
+// Move COPY data the way the server asked for. Returns 1 once the COPY is
+// over and its result can be read, 0 while it waits for the socket or the
+// caller, and -1 when the context has been torn down.
+static int pump_copy(pg_async_t *pg)
+{
+    pg_query_t *query = pg->current_query;
+
+    while (pg->copy_state == COPY_OUT)
     {
-        int init_result = uv_timer_init(uv_default_loop(), &pg->timer);
-        if (init_result != 0)
+        char *buf;
+        int len = PQgetCopyData(pg->conn, &buf, 1);
+        if (len == 0)
         {
-            printf("execute_next_query: uv_timer_init failed: %s\n", uv_strerror(init_result));
-            handle_error(pg, uv_strerror(init_result));
-            return;
+            return 0;
         }
-        pg->handle_initialized = 1;
-        pg->timer.data = pg;
+        if (len == -1)
+        {
+            reset_copy(pg);
+            return 1;
+        }
+        if (len < 0)
+        {
+            handle_error(pg, PQerrorMessage(pg->conn));
+            return -1;
+        }
+
+        // Plain queries that turned out to be COPY, and expired ones, drop
+        // their data
+        if (query && query->copy_data_cb && !(query->flags & QUERY_FAILED))
+        {
+            pg->delivering++;
+            query->copy_data_cb(pg, buf, len, query->data);
+            pg->delivering--;
+        }
+        PQfreemem(buf);
     }
 
-    int start_result = uv_timer_start(&pg->timer, on_timer, 10, 10);
-    if (start_result != 0)
+    for (int calls = 0; pg->copy_state == COPY_IN; calls++)
     {
-        printf("execute_next_query: uv_timer_start failed: %s\n", uv_strerror(start_result));
-        handle_error(pg, uv_strerror(start_result));
-        return;
+        // on_poll comes back here once the output is out
+        if (pg->flushing)
+        {
+            return 0;
+        }
+
+        if (!pg->copy_ending && (!query || !query->copy_write_cb || (query->flags & QUERY_FAILED)))
+        {
+            snprintf(pg->copy_error, sizeof(pg->copy_error), "%s",
+                     query && query->copy_write_cb ? "COPY cancelled" : "COPY FROM STDIN needs pquv_queue_copy_in");
+            pg->copy_ending = 1;
+        }
+
+        if (pg->copy_ending)
+        {
+            int result = PQputCopyEnd(pg->conn, pg->copy_error[0] ? pg->copy_error : NULL);
+            if (result == 0)
+            {
+                // No room for the end message yet
+                return set_poll_events(pg, UV_READABLE | UV_WRITABLE) == 0 ? 0 : -1;
+            }
+            if (result < 0 && PQstatus(pg->conn) == CONNECTION_BAD)
+            {
+                handle_error(pg, PQerrorMessage(pg->conn));
+                return -1;
+            }
+
+            // The server may have ended the COPY first, its result tells
+            reset_copy(pg);
+            if (watch_output(pg) != 0)
+            {
+                handle_error(pg, PQerrorMessage(pg->conn));
+                return -1;
+            }
+            return 1;
+        }
+
+        // Let the other handles on the loop run between batches
+        if (calls == COPY_WRITE_BATCH)
+        {
+            return set_poll_events(pg, UV_READABLE | UV_WRITABLE) == 0 ? 0 : -1;
+        }
+
+        pg->copy_produced = 0;
+        pg->delivering++;
+        query->copy_write_cb(pg, query->data);
+        pg->delivering--;
+
+        if (!pg->copy_produced && !pg->copy_ending)
+        {
+            // The caller resumes with pquv_copy_put, only input matters now
+            return set_poll_events(pg, UV_READABLE | (pg->flushing ? UV_WRITABLE : 0)) == 0 ? 0 : -1;
+        }
     }
 
-#else
-    int sock = PQsocket(pg->conn);
+    return 1;
+}
 
-    if (sock < 0)
+static void reset_copy(pg_async_t *pg)
+{
+    pg->copy_state = COPY_NONE;
+    pg->copy_ending = 0;
+    pg->copy_produced = 0;
+    pg->copy_unflushed = 0;
+    pg->copy_error[0] = '\0';
+}
+
+// Add a query without copying SQL or parameters
+int pquv_queue_borrowed(pg_async_t *pg,
+                        const char *sql,
+                        int param_count,
+                        const char *const *params,
+                        pg_result_cb_t result_cb,
+                        void *query_data)
+{
+    if (!pg || !sql || param_count < 0 || (param_count > 0 && !params))
     {
-        printf("execute_next_query: Invalid socket: %d\n", sock);
-        handle_error(pg, "Invalid PostgreSQL socket");
-        return;
+        LOG_ERROR("Invalid parameters");
+        return -1;
     }
 
-    if (!pg->handle_initialized)
+    if (accepting_queries(pg, "pquv_queue_borrowed") != 0)
     {
-        int init_result = uv_poll_init(uv_default_loop(), &pg->poll, sock);
-        if (init_result != 0)
-        {
-            printf("execute_next_query: uv_poll_init failed: %s\n", uv_strerror(init_result));
-            handle_error(pg, uv_strerror(init_result));
-            return;
-        }
-
-        pg->handle_initialized = 1;
+        return -1;
     }
 
-    int start_result = uv_poll_start(&pg->poll, UV_READABLE | UV_WRITABLE, on_poll);
-    if (start_result != 0)
+    pg_query_t *query = alloc_query(pg);
+    if (!query)
     {
-        printf("execute_next_query: uv_poll_start failed: %s\n", uv_strerror(start_result));
-        handle_error(pg, uv_strerror(start_result));
-        return;
+        LOG_ERROR("Failed to allocate query");
+        return -1;
     }
 
-#endif
+    query->sql = (char *)sql;
+    query->params = (char **)params;
+    query->param_count = param_count;
+    query->result_cb = result_cb;
+    query->data = query_data;
+    query->flags = PQUV_QUERY_BORROWED;
+
+    return enqueue_query(pg, query);
 }
 
-#ifdef _WIN32
-// Timer callback for Windows
-static void on_timer(uv_timer_t *handle)
+// Add a query node filled in and owned by the caller
+int pquv_queue_query(pg_async_t *pg, pg_query_t *query)
 {
-    if (!handle || !handle->data)
+    if (!pg || !query || !query->sql || query->param_count < 0 ||
+        (query->param_count > 0 && !query->params))
     {
-        printf("on_timer: Invalid handle or handle->data\n");
-        return;
+        LOG_ERROR("Invalid parameters");
+        return -1;
     }
 
-    pg_async_t *pg = (pg_async_t *)handle->data;
+    if (accepting_queries(pg, "pquv_queue_query") != 0)
+    {
+        return -1;
+    }
 
-    // Check for shutdown
-    extern int shutdown_requested;
-    if (shutdown_requested)
+    if ((query->copy_write_cb || query->copy_data_cb) && pg->pipeline_window > 0)
     {
-        uv_timer_stop(&pg->timer);
-        if (!uv_is_closing((uv_handle_t *)&pg->timer))
-        {
-            uv_close((uv_handle_t *)&pg->timer, on_timer_closed);
-        }
-        pg->handle_initialized = 0;
-        pg->is_executing = 0;
-        pg_async_destroy(pg);
-        return;
+        LOG_ERROR("COPY is not supported in pipeline mode");
+        return -1;
     }
 
-    // Consume input from the connection
-    if (!PQconsumeInput(pg->conn))
+    query->next = NULL;
+    query->stmt = NULL;
+    query->stmt_id = 0;
+    query->owner = NULL;
+    query->storage = NULL;
+    query->bytes = 0;
+    query->flags = (query->flags & PQUV_QUERY_IDEMPOTENT) | PQUV_QUERY_BORROWED | PQUV_QUERY_CALLER_OWNED;
+
+    return enqueue_query(pg, query);
+}
+
+// Add a query with parameter types, binary parameters and/or binary results
+int pquv_queue_typed(pg_async_t *pg,
+                     const char *sql,
+                     int param_count,
+                     const Oid *param_types,
+                     const char *const *param_values,
+                     const int *param_lengths,
+                     const int *param_formats,
+                     int result_format,
+                     pg_result_cb_t result_cb,
+                     void *query_data)
+{
+    if (!pg || !sql || param_count < 0 || (param_count > 0 && !param_values))
     {
-        printf("on_timer: PQconsumeInput failed: %s\n", PQerrorMessage(pg->conn));
-        handle_error(pg, PQerrorMessage(pg->conn));
-        return;
+        LOG_ERROR("Invalid parameters");
+        return -1;
     }
 
-    // Check if we're still busy
-    if (PQisBusy(pg->conn))
+    if (accepting_queries(pg, "pquv_queue_typed") != 0)
     {
-        return;
+        return -1;
+    }
+
+    pg_query_t *query = create_query(pg, sql, param_count, param_types, param_values,
+                                     param_lengths, param_formats, result_cb, query_data);
+    if (!query)
+    {
+        return -1;
     }
+    query->result_format = result_format;
 
-    // Stop and close timer before processing results
-    uv_timer_stop(&pg->timer);
+    return enqueue_query(pg, query);
+}
 
-    PGresult *result;
-    while ((result = PQgetResult(pg->conn)) != NULL)
+// Take a query node from the context's free list, adding a slab when it is empty
+static pg_query_t *alloc_query(pg_async_t *pg)
+{
+    if (!pg->free_queries)
     {
-        if (pg->current_query && pg->current_query->result_cb)
+        struct pquv_slab *slab = mem_alloc(sizeof(struct pquv_slab));
+        if (!slab)
+            return NULL;
+
+        slab->next = pg->query_slabs;
+        pg->query_slabs = slab;
+        for (int i = QUERY_SLAB_SIZE - 1; i >= 0; i--)
         {
-            pg->current_query->result_cb(pg, result, pg->current_query->data);
+            slab->nodes[i].next = pg->free_queries;
+            pg->free_queries = &slab->nodes[i];
         }
+    }
 
-        ExecStatusType result_status = PQresultStatus(result);
+    pg_query_t *query = pg->free_queries;
+    pg->free_queries = query->next;
+    memset(query, 0, sizeof(*query));
+    return query;
+}
 
-        if (result_status != PGRES_TUPLES_OK && result_status != PGRES_COMMAND_OK)
-        {
-            char *error_msg = strdup(PQresultErrorMessage(result));
-            printf("on_timer: Query error: %s\n", error_msg);
-            PQclear(result);
-            cleanup_query(pg->current_query);
-            pg->current_query = NULL;
-            handle_error(pg, error_msg);
-            free(error_msg);
-            return;
-        }
+static void release_query(pg_async_t *pg, pg_query_t *query)
+{
+    query->next = pg->free_queries;
+    pg->free_queries = query;
+}
 
-        PQclear(result);
+// Bump-allocate from the current arena block. Returns NULL when the request
+// should go to the heap instead.
+static void *arena_alloc(pg_async_t *pg, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    if (size > ARENA_BLOCK_SIZE / 4)
+        return NULL;
+
+    struct pquv_arena_block *block = pg->arena;
+    if (!block || ARENA_BLOCK_SIZE - block->used < size)
+    {
+        if (pg->arena_blocks >= ARENA_MAX_BLOCKS)
+            return NULL;
+
+        block = mem_alloc(sizeof(struct pquv_arena_block));
+        if (!block)
+            return NULL;
+
+        block->next = pg->arena;
+        block->used = 0;
+        pg->arena = block;
+        pg->arena_blocks++;
     }
 
-    cleanup_query(pg->current_query);
-    pg->current_query = NULL;
-    execute_next_query(pg);
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
 }
-#else
-// Poll callback for Unix/Linux
-static void on_poll(uv_poll_t *handle, int status, int events)
+
+// Recycle the arena once no query references it, keeping one block around
+static void arena_reset(pg_async_t *pg)
 {
-    if (!handle || !handle->data)
-    {
-        printf("on_poll: Invalid handle or handle->data\n");
+    struct pquv_arena_block *block = pg->arena;
+    if (!block)
         return;
+
+    struct pquv_arena_block *next = block->next;
+    while (next)
+    {
+        struct pquv_arena_block *after = next->next;
+        mem_free(next);
+        next = after;
     }
 
-    pg_async_t *pg = (pg_async_t *)handle->data;
+    block->next = NULL;
+    block->used = 0;
+    pg->arena_blocks = 1;
+}
 
-    // Check for shutdown
-    extern int shutdown_requested;
-    if (shutdown_requested)
+// Length of a parameter value, binary values are taken by length
+static int param_size(const char *const *param_values,
+                      const int *param_lengths,
+                      const int *param_formats,
+                      int i,
+                      size_t *len)
+{
+    if (param_formats && param_formats[i] == 1)
     {
-        uv_poll_stop(&pg->poll);
-        if (!uv_is_closing((uv_handle_t *)&pg->poll))
+        if (!param_lengths || param_lengths[i] < 0)
         {
-            uv_close((uv_handle_t *)&pg->poll, on_poll_closed);
+            LOG_ERROR("Binary parameter %d has no length", i);
+            return -1;
         }
-        pg->handle_initialized = 0;
-        pg->is_executing = 0;
-        pg_async_destroy(pg);
-        return;
+        *len = (size_t)param_lengths[i];
+        return 0;
     }
 
-    if (status < 0)
+    *len = strlen(param_values[i]);
+    return 0;
+}
+
+// Allocate a query and copy its SQL, parameter values, types and formats into
+// one block, taken from the arena when it fits
+static pg_query_t *create_query(pg_async_t *pg,
+                                const char *sql,
+                                int param_count,
+                                const Oid *param_types,
+                                const char *const *param_values,
+                                const int *param_lengths,
+                                const int *param_formats,
+                                pg_result_cb_t result_cb,
+                                void *query_data)
+{
+    size_t sql_len = strlen(sql) + 1;
+    size_t size = sql_len;
+    if (param_count > 0)
     {
-        printf("on_poll: Poll error: %s\n", uv_strerror(status));
-        handle_error(pg, uv_strerror(status));
-        return;
+        size += param_count * sizeof(char *);
+        if (param_types)
+            size += param_count * sizeof(Oid);
+        if (param_formats)
+            size += 2 * param_count * sizeof(int);
+
+        for (int i = 0; param_values && i < param_count; i++)
+        {
+            size_t len;
+            if (!param_values[i])
+                continue;
+            if (param_size(param_values, param_lengths, param_formats, i, &len) != 0)
+                return NULL;
+            size += len + 1;
+        }
     }
 
-    if (!PQconsumeInput(pg->conn))
+    pg_query_t *query = alloc_query(pg);
+    if (!query)
     {
-        printf("on_poll: PQconsumeInput failed: %s\n", PQerrorMessage(pg->conn));
-        handle_error(pg, PQerrorMessage(pg->conn));
-        return;
+        LOG_ERROR("Failed to allocate query");
+        return NULL;
     }
 
-    if (PQisBusy(pg->conn))
+    char *p = arena_alloc(pg, size);
+    if (p)
     {
-        return;
+        query->flags = QUERY_ARENA;
+    }
+    else
+    {
+        p = query->storage = mem_alloc(size);
+        if (!p)
+        {
+            LOG_ERROR("Failed to copy SQL and parameters");
+            release_query(pg, query);
+            return NULL;
+        }
     }
 
-    // Stop and close poll before processing results
-    uv_poll_stop(&pg->poll);
-
-    PGresult *result;
-    while ((result = PQgetResult(pg->conn)) != NULL)
+    // Pointer-sized arrays first so everything stays aligned
+    if (param_count > 0)
     {
-        if (pg->current_query && pg->current_query->result_cb)
+        query->params = (char **)p;
+        p += param_count * sizeof(char *);
+
+        if (param_types)
         {
-            pg->current_query->result_cb(pg, result, pg->current_query->data);
+            query->param_types = (Oid *)p;
+            memcpy(p, param_types, param_count * sizeof(Oid));
+            p += param_count * sizeof(Oid);
         }
 
-        ExecStatusType result_status = PQresultStatus(result);
+        if (param_formats)
+        {
+            query->param_lengths = (int *)p;
+            p += param_count * sizeof(int);
+            query->param_formats = (int *)p;
+            memcpy(p, param_formats, param_count * sizeof(int));
+            p += param_count * sizeof(int);
+        }
+    }
+
+    query->sql = p;
+    memcpy(p, sql, sql_len);
+    p += sql_len;
 
-        if (result_status != PGRES_TUPLES_OK && result_status != PGRES_COMMAND_OK)
+    for (int i = 0; i < param_count; i++)
+    {
+        size_t len = 0;
+        if (!param_values || !param_values[i])
         {
-            char *error_msg = strdup(PQresultErrorMessage(result));
-            printf("on_poll: Query error: %s\n", error_msg);
-            PQclear(result);
-            cleanup_query(pg->current_query);
-            pg->current_query = NULL;
-            handle_error(pg, error_msg);
-            free(error_msg);
-            return;
+            query->params[i] = NULL;
+        }
+        else
+        {
+            param_size(param_values, param_lengths, param_formats, i, &len);
+            memcpy(p, param_values[i], len);
+            p[len] = '\0';
+            query->params[i] = p;
+            p += len + 1;
         }
 
-        PQclear(result);
+        if (query->param_lengths)
+        {
+            query->param_lengths[i] = (int)len;
+        }
     }
 
-    cleanup_query(pg->current_query);
-    pg->current_query = NULL;
-    execute_next_query(pg);
+    query->param_count = param_count;
+    query->result_cb = result_cb;
+    query->data = query_data;
+
+    return query;
 }
-#endif
 
-// Cleanup a query structure
-static void cleanup_query(pg_query_t *query)
+// Queries are refused once the context is shutting down or being destroyed
+static int accepting_queries(pg_async_t *pg, const char *caller)
 {
-    if (!query)
-        return;
+    if (pg->shutting_down || pg->destroying)
+    {
+        if (LOG_ENABLED(PQUV_LOG_WARN))
+        {
+            log_message(PQUV_LOG_WARN, caller, "Context is shutting down");
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+// Append a query to the tail of the queue. A query refused by the queue
+// limit is freed, unless the caller owns it.
+static int enqueue_query(pg_async_t *pg, pg_query_t *query)
+{
+    if (admit_query(pg, query) != 0)
+    {
+        pg->stats.rejected++;
+        if (!(query->flags & PQUV_QUERY_CALLER_OWNED))
+        {
+            mem_free(query->storage);
+            release_query(pg, query);
+        }
+        return -1;
+    }
+
+    query->queued_at = uv_hrtime();
+    query->sent_at = query->first_at = 0;
+    pg->stats.queued++;
+    trace_query(pg, query, PQUV_TRACE_QUEUED, query->queued_at);
+
+    unsigned int timeout_ms = query->timeout_ms ? query->timeout_ms : pg->timeout_ms;
+    query->deadline = timeout_ms ? uv_now(pg->loop) + timeout_ms : 0;
+    if (query->deadline)
+    {
+        arm_timer(pg, query->deadline);
+    }
 
-    if (query->sql)
+    if (!pg->query_queue)
+    {
+        pg->query_queue = pg->query_queue_tail = query;
+    }
+    else
     {
-        free(query->sql);
+        pg->query_queue_tail->next = query;
+        pg->query_queue_tail = query;
     }
+    pg->queued++;
+    pg->queued_bytes += query->bytes;
+    check_watermarks(pg);
 
-    if (query->params)
+    // Idle persistent contexts pick up new work on their own
+    if (pg->persistent && pg->is_connected && !pg->is_executing && !pg->destroying)
     {
-        for (int i = 0; i < query->param_count; i++)
+        if (pg->coalesce_max > 0)
         {
-            if (query->params[i])
-            {
-                free(query->params[i]);
-            }
+            hold_for_coalesce(pg);
+        }
+        else if (!pg->hold_start)
+        {
+            pquv_execute(pg);
         }
-        free(query->params);
     }
+    return 0;
+}
+
+// SQL and parameter bytes a query holds while it is queued
+static size_t query_bytes(const pg_query_t *query)
+{
+    size_t bytes = strlen(query->sql);
+    for (int i = 0; query->params && i < query->param_count; i++)
+    {
+        if (!query->params[i])
+            continue;
 
-    free(query);
+        int binary = query->param_formats && query->param_formats[i] == 1 && query->param_lengths;
+        bytes += binary ? (size_t)query->param_lengths[i] : strlen(query->params[i]);
+    }
+    return bytes;
 }
 
-// Handle error and cleanup
-static void handle_error(pg_async_t *pg, const char *error)
+static int over_limit(int queued, size_t queued_bytes, int max_queued, size_t max_bytes, size_t bytes)
 {
-    printf("handle_error: %s\n", error ? error : "Unknown error");
+    return (max_queued > 0 && queued >= max_queued) || (max_bytes > 0 && queued_bytes + bytes > max_bytes);
+}
 
-    if (pg->is_executing)
+// Total queue of a pool's connections
+static int pool_queued(const pquv_pool_t *pool, size_t *bytes)
+{
+    int queued = 0;
+    size_t total = 0;
+    for (int i = 0; i < pool->size; i++)
     {
-        if (pg->handle_initialized)
+        if (pool->conns[i])
         {
-#ifdef _WIN32
-            uv_timer_stop(&pg->timer);
-            if (!uv_is_closing((uv_handle_t *)&pg->timer))
-            {
-                uv_close((uv_handle_t *)&pg->timer, on_timer_closed);
-            }
-#else
-            uv_poll_stop(&pg->poll);
-            if (!uv_is_closing((uv_handle_t *)&pg->poll))
-            {
-                uv_close((uv_handle_t *)&pg->poll, on_poll_closed);
-            }
-#endif
-            pg->handle_initialized = 0;
+            queued += pool->conns[i]->queued;
+            total += pool->conns[i]->queued_bytes;
         }
-        pg->is_executing = 0;
     }
-
-    if (pg->error_message)
+    if (bytes)
     {
-        free(pg->error_message);
+        *bytes = total;
     }
-    pg->error_message = error ? strdup(error) : NULL;
+    return queued;
+}
 
-    // Cancel remaining queries
-    pg_async_cancel(pg);
+// Queries that went through the statement cache may have a PREPARE queued
+// for them and stay
+static int sheddable(const pg_query_t *query)
+{
+    return !(query->flags & (QUERY_INTERNAL | QUERY_TX | QUERY_FAILED | QUERY_CACHE_CHECKED));
+}
 
-    // Always auto-cleanup on error
-    printf("handle_error: An error occurred, automatically destroying context\n");
-    pg_async_destroy(pg);
-}
\ No newline at end of file
+// Whether shedding could ever make room for the query, so that nothing is
+// shed for a query that gets refused anyway
+static int can_shed(pg_async_t **conns,
+                    int count,
+                    int queued,
+                    size_t queued_bytes,
+                    int max_queued,
+                    size_t max_bytes,
+                    const pg_query_t *query)
+{
+    if (max_bytes > 0 && query->bytes > max_bytes)
+        return 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        for (const pg_query_t *q = conns[i] ? conns[i]->query_queue : NULL; q; q = q->next)
+        {
+            if (sheddable(q))
+            {
+                queued--;
+                queued_bytes -= q->bytes;
+            }
+        }
+    }
+    return !over_limit(queued, queued_bytes, max_queued, max_bytes, query->bytes);
+}
+
+// Fail the queued query that is first to shed among the given connections:
+// the earliest deadline, then the oldest
+static int shed_query(pg_async_t **conns, int count)
+{
+    pg_async_t *owner = NULL;
+    pg_query_t *victim = NULL;
+    pg_query_t *victim_prev = NULL;
+    uint64_t victim_deadline = 0;
+    for (int i = 0; i < count; i++)
+    {
+        pg_query_t *prev = NULL;
+        for (pg_query_t *query = conns[i] ? conns[i]->query_queue : NULL; query; prev = query, query = query->next)
+        {
+            if (!sheddable(query))
+                continue;
+
+            uint64_t deadline = query->deadline ? query->deadline : UINT64_MAX;
+            if (!victim || deadline < victim_deadline ||
+                (deadline == victim_deadline && query->queued_at < victim->queued_at))
+            {
+                owner = conns[i];
+                victim = query;
+                victim_prev = prev;
+                victim_deadline = deadline;
+            }
+        }
+    }
+
+    if (!victim)
+        return -1;
+
+    if (victim_prev)
+        victim_prev->next = victim->next;
+    else
+        owner->query_queue = victim->next;
+    if (owner->query_queue_tail == victim)
+        owner->query_queue_tail = victim_prev;
+    owner->queued--;
+    owner->queued_bytes -= victim->bytes;
+    owner->stats.rejected++;
+    victim->next = NULL;
+
+    LOG_DEBUG("Queue full, shedding a queued query");
+    fail_query(owner, victim, PQUV_STATUS_REJECTED);
+    check_watermarks(owner);
+    return 0;
+}
+
+// Resolve one breach of a limit: -1 refuses the query, 0 made room by
+// shedding, 1 lets it exceed the limit
+static int make_room(pg_async_t *pg,
+                     const pg_query_t *query,
+                     pquv_overflow_t overflow,
+                     pquv_queue_full_cb_t queue_full_cb,
+                     void *data,
+                     pg_async_t **conns,
+                     int count)
+{
+    switch (overflow)
+    {
+    case PQUV_OVERFLOW_CALLBACK:
+        return queue_full_cb && queue_full_cb(pg, query, data) ? 1 : -1;
+    case PQUV_OVERFLOW_SHED:
+        return shed_query(conns, count);
+    default:
+        return -1;
+    }
+}
+
+// Admission control, the context's limits first and then its pool's
+static int admit_query(pg_async_t *pg, pg_query_t *query)
+{
+    query->bytes = 0;
+    if (query->flags & (QUERY_INTERNAL | QUERY_TX))
+        return 0;
+
+    pquv_pool_t *pool = pg->pool;
+    if (pg->max_queued_bytes || (pool && pool->max_queued_bytes))
+    {
+        query->bytes = query_bytes(query);
+    }
+
+    if (pg->overflow == PQUV_OVERFLOW_SHED &&
+        !can_shed(&pg, 1, pg->queued, pg->queued_bytes, pg->max_queued, pg->max_queued_bytes, query))
+    {
+        LOG_DEBUG("Queue full, refusing the query");
+        return -1;
+    }
+    if (pool && pool->overflow == PQUV_OVERFLOW_SHED)
+    {
+        size_t bytes;
+        int queued = pool_queued(pool, &bytes);
+        if (!can_shed(pool->conns, pool->size, queued, bytes, pool->max_queued, pool->max_queued_bytes, query))
+        {
+            LOG_DEBUG("Pool queue full, refusing the query");
+            return -1;
+        }
+    }
+
+    while (over_limit(pg->queued, pg->queued_bytes, pg->max_queued, pg->max_queued_bytes, query->bytes))
+    {
+        int room = make_room(pg, query, pg->overflow, pg->queue_full_cb, pg->queue_full_data, &pg, 1);
+        if (room < 0)
+        {
+            LOG_DEBUG("Queue full, refusing the query");
+            return -1;
+        }
+        if (room > 0)
+            break;
+    }
+
+    if (!pool || (!pool->max_queued && !pool->max_queued_bytes))
+        return 0;
+
+    for (;;)
+    {
+        size_t bytes;
+        int queued = pool_queued(pool, &bytes);
+        if (!over_limit(queued, bytes, pool->max_queued, pool->max_queued_bytes, query->bytes))
+            return 0;
+
+        int room = make_room(pg, query, pool->overflow, pool->queue_full_cb, pool->queue_full_data, pool->conns,
+                             pool->size);
+        if (room < 0)
+        {
+            LOG_DEBUG("Pool queue full, refusing the query");
+            return -1;
+        }
+        if (room > 0)
+            return 0;
+    }
+}
+
+// Report crossings of the context's and its pool's watermarks
+static void check_watermarks(pg_async_t *pg)
+{
+    if (pg->high_watermark && (pg->above_watermark ? pg->queued <= pg->low_watermark : pg->queued >= pg->high_watermark))
+    {
+        pg->above_watermark = !pg->above_watermark;
+        pg->delivering++;
+        pg->watermark_cb(pg->above_watermark, pg->watermark_data);
+        pg->delivering--;
+    }
+
+    pquv_pool_t *pool = pg->pool;
+    if (pool && pool->high_watermark)
+    {
+        int queued = pool_queued(pool, NULL);
+        if (pool->above_watermark ? queued <= pool->low_watermark : queued >= pool->high_watermark)
+        {
+            pool->above_watermark = !pool->above_watermark;
+            pg->delivering++;
+            pool->watermark_cb(pool->above_watermark, pool->watermark_data);
+            pg->delivering--;
+        }
+    }
+}
+
+// Start executing queued queries
+int pquv_execute(pg_async_t *pg)
+{
+    if (!pg)
+    {
+        LOG_ERROR("pg is NULL");
+        return -1;
+    }
+
+    if (!pg->is_connected)
+    {
+        LOG_WARN("Not connected");
+        return -1;
+    }
+
+    if (pg->is_executing)
+    {
+        LOG_WARN("Already executing");
+        return -1;
+    }
+
+    if (!pg->query_queue)
+    {
+        // Always auto-cleanup when no queries remain
+        finish_execution(pg);
+        return 0;
+    }
+
+    pg->is_executing = 1;
+    execute_next_query(pg);
+    return 0;
+}
+
+// Keep the context alive and idle when its queue drains
+int pquv_set_persistent(pg_async_t *pg, int persistent)
+{
+    if (!pg)
+    {
+        LOG_ERROR("pg is NULL");
+        return -1;
+    }
+
+    if (pg->pool)
+    {
+        LOG_ERROR("Pooled connections are always persistent");
+        return -1;
+    }
+
+    pg->persistent = persistent ? 1 : 0;
+    return 0;
+}
+
+// Cancel everything queued and destroy a context
+void pquv_destroy(pg_async_t *pg)
+{
+    if (!pg)
+        return;
+
+    if (pg->pool)
+    {
+        LOG_ERROR("Pooled connections are destroyed with their pool");
+        return;
+    }
+
+    pg_async_destroy(pg);
+}
+
+// Set the timeout for queries queued from now on
+int pquv_set_timeout(pg_async_t *pg, unsigned int timeout_ms)
+{
+    if (!pg)
+    {
+        LOG_ERROR("pg is NULL");
+        return -1;
+    }
+
+    pg->timeout_ms = timeout_ms;
+    return 0;
+}
+
+int pquv_set_reconnect(pg_async_t *pg, unsigned int min_ms, unsigned int max_ms, int max_attempts)
+{
+    if (!pg || max_attempts < 0 || (min_ms && max_ms < min_ms))
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    pg->reconnect_min_ms = min_ms;
+    pg->reconnect_max_ms = max_ms;
+    pg->reconnect_max_attempts = max_attempts;
+    return 0;
+}
+
+int pquv_set_queue_limit(pg_async_t *pg,
+                         int max_queries,
+                         size_t max_bytes,
+                         pquv_overflow_t overflow,
+                         pquv_queue_full_cb_t queue_full_cb,
+                         void *data)
+{
+    if (!pg || max_queries < 0 || (overflow == PQUV_OVERFLOW_CALLBACK && !queue_full_cb))
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    pg->max_queued = max_queries;
+    pg->max_queued_bytes = max_bytes;
+    pg->overflow = overflow;
+    pg->queue_full_cb = queue_full_cb;
+    pg->queue_full_data = data;
+    return 0;
+}
+
+int pquv_set_watermarks(pg_async_t *pg, int high, int low, pquv_watermark_cb_t watermark_cb, void *data)
+{
+    if (!pg || high < 0 || (high > 0 && (low < 0 || low >= high || !watermark_cb)))
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    pg->high_watermark = high;
+    pg->low_watermark = low;
+    pg->above_watermark = 0;
+    pg->watermark_cb = watermark_cb;
+    pg->watermark_data = data;
+    return 0;
+}
+
+int pquv_listen(pg_async_t *pg, const char *channel, pquv_notify_cb_t notify_cb, void *data)
+{
+    if (!pg || !channel || !*channel || !notify_cb)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    if (!pg->persistent)
+    {
+        LOG_ERROR("Listening needs a persistent context");
+        return -1;
+    }
+
+    if (accepting_queries(pg, "pquv_listen") != 0)
+    {
+        return -1;
+    }
+
+    int subscribed = 0;
+    for (struct pquv_listener *l = pg->listeners; l; l = l->next)
+    {
+        if (l->notify_cb && strcmp(l->channel, channel) == 0)
+        {
+            subscribed = 1;
+            break;
+        }
+    }
+
+    size_t len = strlen(channel) + 1;
+    struct pquv_listener *listener = mem_alloc(sizeof(*listener) + len);
+    if (!listener)
+    {
+        LOG_ERROR("Failed to allocate listener");
+        return -1;
+    }
+    listener->notify_cb = notify_cb;
+    listener->data = data;
+    memcpy(listener->channel, channel, len);
+
+    if (!subscribed && queue_listen(pg, "LISTEN", channel, 0) != 0)
+    {
+        mem_free(listener);
+        return -1;
+    }
+
+    listener->next = pg->listeners;
+    pg->listeners = listener;
+    return 0;
+}
+
+int pquv_unlisten(pg_async_t *pg, const char *channel, pquv_notify_cb_t notify_cb, void *data)
+{
+    if (!pg || !channel)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    int removed = 0;
+    int remaining = 0;
+    for (struct pquv_listener *l = pg->listeners; l; l = l->next)
+    {
+        if (!l->notify_cb || strcmp(l->channel, channel) != 0)
+            continue;
+
+        if (!removed && l->notify_cb == notify_cb && l->data == data)
+        {
+            l->notify_cb = NULL;
+            removed = 1;
+        }
+        else
+        {
+            remaining++;
+        }
+    }
+
+    if (!removed)
+    {
+        LOG_ERROR("Not subscribed to %s", channel);
+        return -1;
+    }
+
+    if (!pg->notifying)
+    {
+        sweep_listeners(pg);
+    }
+
+    // Nothing can run on a context being torn down, and it is not needed
+    if (!remaining && !pg->shutting_down && !pg->destroying)
+    {
+        queue_listen(pg, "UNLISTEN", channel, 0);
+    }
+    return 0;
+}
+
+// Queue LISTEN or UNLISTEN for a channel, internally so no callback runs
+static int queue_listen(pg_async_t *pg, const char *command, const char *channel, int front)
+{
+    char *ident = PQescapeIdentifier(pg->conn, channel, strlen(channel));
+    if (!ident)
+    {
+        LOG_ERROR("PQescapeIdentifier failed: %s", PQerrorMessage(pg->conn));
+        return -1;
+    }
+
+    size_t len = strlen(command) + strlen(ident) + 2;
+    char *sql = mem_alloc(len);
+    if (!sql)
+    {
+        PQfreemem(ident);
+        LOG_ERROR("Failed to allocate %s", command);
+        return -1;
+    }
+    snprintf(sql, len, "%s %s", command, ident);
+    PQfreemem(ident);
+
+    pg_query_t *query = create_query(pg, sql, 0, NULL, NULL, NULL, NULL, NULL, NULL);
+    mem_free(sql);
+    if (!query)
+    {
+        return -1;
+    }
+    query->flags |= QUERY_INTERNAL;
+
+    if (front)
+    {
+        push_query(pg, query);
+    }
+    else
+    {
+        enqueue_query(pg, query);
+    }
+    return 0;
+}
+
+// Hand every notification libpq has parsed to the channel's subscribers
+static void dispatch_notifies(pg_async_t *pg)
+{
+    PGnotify *notify;
+    while ((notify = PQnotifies(pg->conn)) != NULL)
+    {
+        pg->notifying++;
+        pg->delivering++;
+        for (struct pquv_listener *l = pg->listeners; l; l = l->next)
+        {
+            if (l->notify_cb && strcmp(l->channel, notify->relname) == 0)
+            {
+                l->notify_cb(pg, notify->relname, notify->extra, notify->be_pid, l->data);
+            }
+        }
+        pg->delivering--;
+        pg->notifying--;
+        PQfreemem(notify);
+    }
+
+    if (!pg->notifying)
+    {
+        sweep_listeners(pg);
+    }
+}
+
+// Free subscriptions removed while their channel was being dispatched
+static void sweep_listeners(pg_async_t *pg)
+{
+    struct pquv_listener **link = &pg->listeners;
+    while (*link)
+    {
+        struct pquv_listener *l = *link;
+        if (l->notify_cb)
+        {
+            link = &l->next;
+            continue;
+        }
+        *link = l->next;
+        mem_free(l);
+    }
+}
+
+pquv_cache_t *pquv_cache_create(size_t max_bytes, unsigned int ttl_ms)
+{
+    if (max_bytes == 0)
+    {
+        LOG_ERROR("Invalid parameters");
+        return NULL;
+    }
+
+    pquv_cache_t *cache = mem_calloc(1, sizeof(pquv_cache_t));
+    if (!cache)
+    {
+        LOG_ERROR("Failed to allocate memory");
+        return NULL;
+    }
+
+    // About one bucket per KiB the cache may hold
+    size_t buckets = CACHE_MIN_BUCKETS;
+    while (buckets < CACHE_MAX_BUCKETS && buckets * 1024 < max_bytes)
+    {
+        buckets *= 2;
+    }
+
+    cache->buckets = mem_calloc(buckets, sizeof(struct pquv_cache_entry *));
+    if (!cache->buckets)
+    {
+        LOG_ERROR("Failed to allocate memory");
+        mem_free(cache);
+        return NULL;
+    }
+    cache->bucket_mask = buckets - 1;
+    cache->max_bytes = max_bytes;
+    cache->ttl_ms = ttl_ms;
+    return cache;
+}
+
+void pquv_cache_destroy(pquv_cache_t *cache)
+{
+    if (!cache)
+        return;
+
+    pquv_cache_clear(cache);
+    mem_free(cache->buckets);
+    mem_free(cache);
+}
+
+void pquv_cache_clear(pquv_cache_t *cache)
+{
+    if (!cache)
+        return;
+
+    while (cache->newest)
+    {
+        cache_remove(cache, cache->newest);
+    }
+}
+
+int pquv_cache_listen(pquv_cache_t *cache, pg_async_t *pg, const char *channel)
+{
+    if (!cache || !pg || !channel)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    return pquv_listen(pg, channel, on_cache_notify, cache);
+}
+
+int pquv_set_cache(pg_async_t *pg, pquv_cache_t *cache)
+{
+    if (!pg)
+    {
+        LOG_ERROR("pg is NULL");
+        return -1;
+    }
+
+    pg->cache = cache;
+    return 0;
+}
+
+int pquv_queue_cached(pg_async_t *pg,
+                      const char *sql,
+                      int param_count,
+                      const char **params,
+                      pg_result_cb_t result_cb,
+                      void *query_data)
+{
+    if (!pg || !sql || param_count < 0 || (param_count > 0 && !params))
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    if (accepting_queries(pg, "pquv_queue_cached") != 0)
+    {
+        return -1;
+    }
+
+    // The callback may keep the copy, the cached result stays untouched
+    struct pquv_cache_entry *entry =
+        pg->cache ? cache_lookup(pg->cache, pg->loop, sql, param_count, (const char *const *)params) : NULL;
+    if (entry)
+    {
+        PGresult *copy = PQcopyResult(entry->result, PG_COPYRES_ATTRS | PG_COPYRES_TUPLES);
+        if (copy)
+        {
+            pg->stats.cache_hits++;
+            if (!result_cb || !deliver(pg, result_cb, copy, query_data, PQUV_STATUS_OK))
+            {
+                PQclear(copy);
+            }
+            return 0;
+        }
+        LOG_WARN("PQcopyResult failed");
+    }
+
+    pg_query_t *query = create_query(pg, sql, param_count, NULL, (const char *const *)params,
+                                     NULL, NULL, result_cb, query_data);
+    if (!query)
+    {
+        return -1;
+    }
+
+    query->flags |= QUERY_CACHE_FILL;
+    return enqueue_query(pg, query);
+}
+
+// FNV-1a over the key the query would be cached under
+static uint64_t cache_hash(const char *sql, int param_count, const char *const *params, size_t *key_len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t len = 0;
+    for (int i = -1; i < param_count; i++)
+    {
+        const unsigned char *p = (const unsigned char *)(i < 0 ? sql : params[i]);
+        if (i >= 0)
+        {
+            hash ^= p ? CACHE_PARAM_VALUE : CACHE_PARAM_NULL;
+            hash *= 1099511628211ULL;
+            len++;
+        }
+        for (; p && *p; p++, len++)
+        {
+            hash ^= *p;
+            hash *= 1099511628211ULL;
+        }
+        if (i < 0 || p)
+        {
+            hash *= 1099511628211ULL;
+            len++;
+        }
+    }
+
+    *key_len = len;
+    return hash;
+}
+
+// Whether entry's key is for the SQL and parameters
+static int cache_key_matches(const struct pquv_cache_entry *entry, const char *sql, int param_count,
+                             const char *const *params)
+{
+    const char *key = entry->key;
+    const char *end = key + entry->key_len;
+    size_t len = strlen(sql) + 1;
+    if ((size_t)(end - key) < len || memcmp(key, sql, len) != 0)
+        return 0;
+    key += len;
+
+    for (int i = 0; i < param_count; i++)
+    {
+        if (key == end || *key++ != (params[i] ? CACHE_PARAM_VALUE : CACHE_PARAM_NULL))
+            return 0;
+        if (!params[i])
+            continue;
+
+        len = strlen(params[i]) + 1;
+        if ((size_t)(end - key) < len || memcmp(key, params[i], len) != 0)
+            return 0;
+        key += len;
+    }
+    return key == end;
+}
+
+static void cache_link_newest(pquv_cache_t *cache, struct pquv_cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->newest;
+    if (cache->newest)
+        cache->newest->prev = entry;
+    else
+        cache->oldest = entry;
+    cache->newest = entry;
+}
+
+static void cache_unlink(pquv_cache_t *cache, struct pquv_cache_entry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache->newest = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache->oldest = entry->prev;
+}
+
+static struct pquv_cache_entry *cache_lookup(pquv_cache_t *cache, uv_loop_t *loop, const char *sql, int param_count,
+                                             const char *const *params)
+{
+    size_t key_len;
+    uint64_t hash = cache_hash(sql, param_count, params, &key_len);
+    struct pquv_cache_entry *entry = cache->buckets[hash & cache->bucket_mask];
+    while (entry && (entry->hash != hash || entry->key_len != key_len ||
+                     !cache_key_matches(entry, sql, param_count, params)))
+    {
+        entry = entry->chain;
+    }
+
+    if (!entry)
+        return NULL;
+
+    if (entry->expires && entry->expires <= uv_now(loop))
+    {
+        cache_remove(cache, entry);
+        return NULL;
+    }
+
+    cache_unlink(cache, entry);
+    cache_link_newest(cache, entry);
+    return entry;
+}
+
+// Cache a copy of a query's final result
+static void cache_store(pg_async_t *pg, const pg_query_t *query, const PGresult *result)
+{
+    pquv_cache_t *cache = pg->cache;
+    const char *const *params = (const char *const *)query->params;
+
+    // Rough footprint: values, a pointer and a length per value, the key
+    size_t key_len;
+    uint64_t hash = cache_hash(query->sql, query->param_count, params, &key_len);
+    int rows = PQntuples(result);
+    int fields = PQnfields(result);
+    size_t bytes = sizeof(struct pquv_cache_entry) + key_len + (size_t)rows * fields * 16 + fields * 64;
+    for (int r = 0; r < rows; r++)
+    {
+        for (int f = 0; f < fields; f++)
+        {
+            bytes += PQgetlength(result, r, f) + 1;
+        }
+    }
+    if (bytes > cache->max_bytes)
+    {
+        return;
+    }
+
+    PGresult *owned = PQcopyResult(result, PG_COPYRES_ATTRS | PG_COPYRES_TUPLES);
+    struct pquv_cache_entry *entry = owned ? mem_alloc(sizeof(struct pquv_cache_entry) + key_len) : NULL;
+    if (!entry)
+    {
+        LOG_WARN("Failed to cache result");
+        if (owned)
+        {
+            PQclear(owned);
+        }
+        return;
+    }
+
+    // Lay the key out the way cache_key_matches reads it
+    char *p = entry->key;
+    size_t len = strlen(query->sql) + 1;
+    memcpy(p, query->sql, len);
+    p += len;
+    for (int i = 0; i < query->param_count; i++)
+    {
+        *p++ = params[i] ? CACHE_PARAM_VALUE : CACHE_PARAM_NULL;
+        if (params[i])
+        {
+            len = strlen(params[i]) + 1;
+            memcpy(p, params[i], len);
+            p += len;
+        }
+    }
+
+    // A result for the same key that arrived earlier is replaced
+    struct pquv_cache_entry *old = cache->buckets[hash & cache->bucket_mask];
+    while (old && (old->hash != hash || old->key_len != key_len ||
+                   !cache_key_matches(old, query->sql, query->param_count, params)))
+    {
+        old = old->chain;
+    }
+    if (old)
+    {
+        cache_remove(cache, old);
+    }
+
+    entry->hash = hash;
+    entry->key_len = key_len;
+    entry->bytes = bytes;
+    entry->result = owned;
+    entry->expires = cache->ttl_ms ? uv_now(pg->loop) + cache->ttl_ms : 0;
+    entry->chain = cache->buckets[hash & cache->bucket_mask];
+    cache->buckets[hash & cache->bucket_mask] = entry;
+    cache_link_newest(cache, entry);
+    cache->bytes += bytes;
+
+    while (cache->bytes > cache->max_bytes)
+    {
+        cache_remove(cache, cache->oldest);
+    }
+}
+
+static void cache_remove(pquv_cache_t *cache, struct pquv_cache_entry *entry)
+{
+    struct pquv_cache_entry **link = &cache->buckets[entry->hash & cache->bucket_mask];
+    while (*link != entry)
+    {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+
+    cache_unlink(cache, entry);
+    cache->bytes -= entry->bytes;
+    PQclear(entry->result);
+    mem_free(entry);
+}
+
+static void on_cache_notify(pg_async_t *pg, const char *channel, const char *payload, int be_pid, void *data)
+{
+    (void)pg;
+    (void)channel;
+    (void)be_pid;
+    pquv_cache_t *cache = (pquv_cache_t *)data;
+
+    // The key starts with the SQL, so the search stops before the parameters
+    struct pquv_cache_entry *entry = cache->newest;
+    while (entry)
+    {
+        struct pquv_cache_entry *next = entry->next;
+        if (!*payload || strstr(entry->key, payload))
+        {
+            cache_remove(cache, entry);
+        }
+        entry = next;
+    }
+}
+
+int pquv_stats(const pg_async_t *pg, pquv_stats_t *out)
+{
+    if (!pg || !out)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    *out = pg->stats;
+    out->queue_depth = pg->queued;
+    out->in_flight = pg->in_flight;
+    return 0;
+}
+
+void pquv_stats_reset(pg_async_t *pg)
+{
+    if (pg)
+    {
+        memset(&pg->stats, 0, sizeof(pg->stats));
+    }
+}
+
+uint64_t pquv_histogram_percentile(const pquv_histogram_t *hist, double percentile)
+{
+    if (!hist || hist->count == 0)
+        return 0;
+
+    // Rank of the sample the percentile falls on, counted from 1
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)hist->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < PQUV_HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen >= rank)
+        {
+            uint64_t bound = (2ULL << i) - 1;
+            return bound < hist->max_usec ? bound : hist->max_usec;
+        }
+    }
+    return hist->max_usec;
+}
+
+int pquv_set_trace(pg_async_t *pg, pquv_trace_cb_t trace_cb, void *data)
+{
+    if (!pg)
+    {
+        LOG_ERROR("pg is NULL");
+        return -1;
+    }
+
+    pg->trace_cb = trace_cb;
+    pg->trace_data = data;
+    return 0;
+}
+
+// Add the duration between two uv_hrtime() timestamps to a histogram
+static void hist_record(pquv_histogram_t *hist, uint64_t start, uint64_t end)
+{
+    uint64_t usec = end > start ? (end - start) / 1000 : 0;
+    int bucket = 0;
+    while (bucket < PQUV_HIST_BUCKETS - 1 && (usec >> (bucket + 1)) != 0)
+    {
+        bucket++;
+    }
+
+    hist->count++;
+    hist->sum_usec += usec;
+    hist->buckets[bucket]++;
+    if (usec > hist->max_usec)
+    {
+        hist->max_usec = usec;
+    }
+}
+
+static void hist_merge(pquv_histogram_t *into, const pquv_histogram_t *from)
+{
+    into->count += from->count;
+    into->sum_usec += from->sum_usec;
+    if (from->max_usec > into->max_usec)
+    {
+        into->max_usec = from->max_usec;
+    }
+    for (int i = 0; i < PQUV_HIST_BUCKETS; i++)
+    {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+static void trace_query(pg_async_t *pg, const pg_query_t *query, pquv_trace_event_t event, uint64_t time)
+{
+    if (pg->trace_cb && !(query->flags & QUERY_INTERNAL))
+    {
+        pg->trace_cb(pg, query, event, time, pg->trace_data);
+    }
+}
+
+// Stop accepting queries and destroy the context once its work is done
+int pquv_shutdown(pg_async_t *pg, int graceful, unsigned int timeout_ms)
+{
+    if (!pg)
+    {
+        LOG_ERROR("pg is NULL");
+        return -1;
+    }
+
+    if (pg->pool)
+    {
+        LOG_ERROR("Pooled connections are shut down with pquv_pool_shutdown");
+        return -1;
+    }
+
+    shutdown_context(pg, graceful, timeout_ms);
+    return 0;
+}
+
+static void shutdown_context(pg_async_t *pg, int graceful, unsigned int timeout_ms)
+{
+    if (pg->destroying || pg->shutting_down)
+        return;
+
+    pg->shutting_down = 1;
+
+    // Nothing to drain, or no connection to drain it on. Inside a callback
+    // the context is still in use, the timer destroys it right after.
+    if (!graceful || (!pg->query_queue && !pg->current_query) || (!pg->is_connected && !pg->is_connecting))
+    {
+        if (!pg->delivering)
+        {
+            pg_async_destroy(pg);
+            return;
+        }
+        timeout_ms = 0;
+        pg->shutdown_deadline = uv_now(pg->loop);
+        arm_timer(pg, pg->shutdown_deadline);
+    }
+
+    if (timeout_ms)
+    {
+        pg->shutdown_deadline = uv_now(pg->loop) + timeout_ms;
+        arm_timer(pg, pg->shutdown_deadline);
+    }
+
+    // Queued work still runs, finish_execution destroys the context after it
+    if (pg->is_connected && !pg->is_executing)
+    {
+        pquv_execute(pg);
+    }
+}
+
+// Configure pipeline mode
+int pquv_set_pipeline(pg_async_t *pg, int max_in_flight)
+{
+    if (!pg || max_in_flight < 0)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    if (pg->is_executing)
+    {
+        LOG_ERROR("Cannot change pipeline mode while executing");
+        return -1;
+    }
+
+    if (max_in_flight == 0 && pg->in_pipeline)
+    {
+        if (!PQexitPipelineMode(pg->conn))
+        {
+            LOG_ERROR("PQexitPipelineMode failed: %s", PQerrorMessage(pg->conn));
+            return -1;
+        }
+        pg->in_pipeline = 0;
+    }
+
+    pg->pipeline_window = max_in_flight;
+    return 0;
+}
+
+int pquv_set_coalesce(pg_async_t *pg, int max_queries, unsigned int window_usec)
+{
+    if (!pg || max_queries < 0)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    pg->coalesce_max = max_queries;
+    pg->coalesce_usec = window_usec;
+
+    // Whatever is being collected goes out now
+    if (max_queries == 0 && pg->coalesce_start)
+    {
+        release_coalesced(pg);
+    }
+    return 0;
+}
+
+// Open the window on the first query, close it once enough are queued
+static void hold_for_coalesce(pg_async_t *pg)
+{
+    if (!pg->coalesce_start)
+    {
+        if (!pg->coalesce_initialized)
+        {
+            // uv_idle_init cannot fail once uv_check_init has succeeded
+            int init_result = uv_check_init(pg->loop, &pg->coalesce);
+            if (init_result == 0)
+            {
+                uv_idle_init(pg->loop, &pg->coalesce_spin);
+            }
+            if (init_result != 0)
+            {
+                LOG_ERROR("uv_check_init failed: %s", uv_strerror(init_result));
+                if (!pg->hold_start)
+                {
+                    pquv_execute(pg);
+                }
+                return;
+            }
+            pg->coalesce.data = pg;
+            pg->coalesce_spin.data = pg;
+            pg->coalesce_initialized = 1;
+            pg->open_handles += 2;
+        }
+
+        uv_check_start(&pg->coalesce, on_coalesce);
+        pg->coalesce_start = uv_hrtime();
+        pg->hold_start++;
+    }
+
+    if (pg->queued >= pg->coalesce_max)
+    {
+        release_coalesced(pg);
+    }
+}
+
+static void release_coalesced(pg_async_t *pg)
+{
+    uv_check_stop(&pg->coalesce);
+    uv_idle_stop(&pg->coalesce_spin);
+    pg->coalesce_start = 0;
+    if (--pg->hold_start == 0 && pg->is_connected && !pg->is_executing && !pg->destroying && pg->query_queue)
+    {
+        pquv_execute(pg);
+    }
+}
+
+// Nothing to do, the check that follows looks at the window again
+static void on_coalesce_spin(uv_idle_t *handle)
+{
+    (void)handle;
+}
+
+// Runs after the loop has polled for I/O, so every callback of this
+// iteration has had its chance to queue
+static void on_coalesce(uv_check_t *handle)
+{
+    pg_async_t *pg = (pg_async_t *)handle->data;
+    uint64_t waited = (uv_hrtime() - pg->coalesce_start) / 1000;
+    if (waited >= pg->coalesce_usec)
+    {
+        release_coalesced(pg);
+        return;
+    }
+
+    // The loop would otherwise block in poll. Timers run in whole
+    // milliseconds, so one wakes it for those and the rest is spun off with
+    // an idle handle, which makes the loop poll without blocking.
+    uint64_t remaining_ms = (pg->coalesce_usec - waited) / 1000;
+    if (remaining_ms > 0)
+    {
+        arm_timer(pg, uv_now(pg->loop) + remaining_ms);
+    }
+    else
+    {
+        uv_idle_start(&pg->coalesce_spin, on_coalesce_spin);
+    }
+}
+
+// Configure the prepared statement cache
+int pquv_set_statement_cache(pg_async_t *pg, int capacity)
+{
+    if (!pg || capacity < 0)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    if (pg->is_executing)
+    {
+        LOG_ERROR("Cannot change the cache while executing");
+        return -1;
+    }
+
+    pg_stmt_t *cache = NULL;
+    if (capacity > 0)
+    {
+        cache = mem_calloc(capacity, sizeof(pg_stmt_t));
+        if (!cache)
+        {
+            LOG_ERROR("Failed to allocate cache");
+            return -1;
+        }
+    }
+
+    replace_statement_cache(pg, cache, capacity);
+    return 0;
+}
+
+static void replace_statement_cache(pg_async_t *pg, pg_stmt_t *cache, int capacity)
+{
+    // Forgotten statements stay prepared on the server under their unique names
+    for (int i = 0; i < pg->stmt_capacity; i++)
+    {
+        forget_statement(&pg->stmt_cache[i]);
+    }
+    mem_free(pg->stmt_cache);
+
+    pg->stmt_cache = cache;
+    pg->stmt_capacity = capacity;
+}
+
+// Create a pool of connections on the default loop
+pquv_pool_t *pquv_pool_create(const char *conninfo, int size, void *data)
+{
+    return pquv_pool_create_ex(uv_default_loop(), conninfo, size, data);
+}
+
+// Create a pool of connections on the given loop
+pquv_pool_t *pquv_pool_create_ex(uv_loop_t *loop, const char *conninfo, int size, void *data)
+{
+    pquv_pool_node_t node = {conninfo, PQUV_ROLE_PRIMARY, size};
+    return pquv_pool_create_nodes(loop, &node, 1, data);
+}
+
+pquv_pool_t *pquv_pool_create_nodes(uv_loop_t *loop, const pquv_pool_node_t *nodes, int node_count, void *data)
+{
+    if (!loop || !nodes || node_count <= 0)
+    {
+        LOG_ERROR("Invalid parameters");
+        return NULL;
+    }
+
+    int size = 0;
+    for (int i = 0; i < node_count; i++)
+    {
+        if (!nodes[i].conninfo || nodes[i].size <= 0 ||
+            (nodes[i].role != PQUV_ROLE_PRIMARY && nodes[i].role != PQUV_ROLE_REPLICA))
+        {
+            LOG_ERROR("Invalid node %d", i);
+            return NULL;
+        }
+        size += nodes[i].size;
+    }
+
+    pquv_pool_t *pool = mem_calloc(1, sizeof(pquv_pool_t));
+    if (!pool)
+    {
+        LOG_ERROR("Failed to allocate memory");
+        return NULL;
+    }
+
+    pool->conns = mem_calloc(size, sizeof(pg_async_t *));
+    if (!pool->conns)
+    {
+        LOG_ERROR("Failed to allocate connections");
+        mem_free(pool);
+        return NULL;
+    }
+
+    pool->loop = loop;
+    pool->data = data;
+
+    // Woken from other threads, it does not keep the loop alive by itself
+    pool->remote = mem_calloc(1, sizeof(struct pquv_remote));
+    if (!pool->remote || uv_async_init(loop, &pool->remote->async, on_submit) != 0)
+    {
+        LOG_ERROR("Failed to set up submissions");
+        mem_free(pool->remote);
+        mem_free(pool->conns);
+        mem_free(pool);
+        return NULL;
+    }
+    pool->remote->pool = pool;
+    pool->remote->async.data = pool->remote;
+    uv_unref((uv_handle_t *)&pool->remote->async);
+
+    // Connections are established in the background by the event loop
+    for (int n = 0; n < node_count; n++)
+    {
+        for (int i = 0; i < nodes[n].size; i++)
+        {
+            pg_async_t *pg = pquv_connect(loop, nodes[n].conninfo, NULL, pool);
+            if (!pg)
+            {
+                LOG_WARN("Connection %d to node %d failed to start", i, n);
+                pquv_pool_destroy(pool);
+                return NULL;
+            }
+
+            pg->pool = pool;
+            pg->persistent = 1;
+            pg->role = nodes[n].role;
+            pool->conns[pool->size++] = pg;
+        }
+    }
+
+    return pool;
+}
+
+// Queue a query on the least loaded connection and start it if idle
+int pquv_pool_queue(pquv_pool_t *pool,
+                    const char *sql,
+                    int param_count,
+                    const char **params,
+                    pg_result_cb_t result_cb,
+                    void *query_data)
+{
+    if (!pool || !sql || pool->destroying || pool->shutting_down)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    pg_async_t *target = select_connection(pool, 0);
+    if (!target)
+    {
+        return -1;
+    }
+
+    return pquv_queue(target, sql, param_count, params, result_cb, query_data);
+}
+
+// Queue a read-only query, on a replica when one is usable
+int pquv_pool_queue_read(pquv_pool_t *pool,
+                         const char *sql,
+                         int param_count,
+                         const char **params,
+                         pg_result_cb_t result_cb,
+                         void *query_data)
+{
+    if (!pool || !sql || pool->destroying || pool->shutting_down)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    pg_async_t *target = select_connection(pool, 1);
+    if (!target)
+    {
+        return -1;
+    }
+
+    return pquv_queue(target, sql, param_count, params, result_cb, query_data);
+}
+
+int pquv_pool_queue_idempotent(pquv_pool_t *pool,
+                               const char *sql,
+                               int param_count,
+                               const char **params,
+                               pg_result_cb_t result_cb,
+                               void *query_data)
+{
+    if (!pool || !sql || pool->destroying || pool->shutting_down)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    pg_async_t *target = select_connection(pool, 0);
+    if (!target)
+    {
+        return -1;
+    }
+
+    return pquv_queue_idempotent(target, sql, param_count, params, result_cb, query_data);
+}
+
+// Queue a caller-owned query on the least loaded connection
+int pquv_pool_queue_query(pquv_pool_t *pool, pg_query_t *query)
+{
+    if (!pool || !query || pool->destroying || pool->shutting_down)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    pg_async_t *target = select_connection(pool, (query->flags & PQUV_QUERY_READ_ONLY) != 0);
+    if (!target)
+    {
+        return -1;
+    }
+
+    return pquv_queue_query(target, query);
+}
+
+int pquv_pool_submit(pquv_pool_t *pool,
+                     pquv_mailbox_t *mailbox,
+                     const char *sql,
+                     int param_count,
+                     const char **params,
+                     pquv_submit_cb_t submit_cb,
+                     void *data)
+{
+    if (!pool || !sql || !submit_cb || param_count < 0 || (param_count > 0 && !params))
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    // The submission, its parameter array, SQL and values in one block
+    size_t size = sizeof(struct pquv_submission) + param_count * sizeof(char *) + strlen(sql) + 1;
+    for (int i = 0; i < param_count; i++)
+    {
+        size += params[i] ? strlen(params[i]) + 1 : 0;
+    }
+
+    struct pquv_submission *sub = mem_alloc(size);
+    if (!sub)
+    {
+        LOG_ERROR("Failed to allocate submission");
+        return -1;
+    }
+    memset(sub, 0, sizeof(*sub));
+
+    char **values = (char **)(sub + 1);
+    char *p = (char *)(values + param_count);
+    for (int i = 0; i < param_count; i++)
+    {
+        values[i] = NULL;
+        if (params[i])
+        {
+            size_t len = strlen(params[i]) + 1;
+            memcpy(p, params[i], len);
+            values[i] = p;
+            p += len;
+        }
+    }
+    memcpy(p, sql, strlen(sql) + 1);
+
+    sub->query.sql = p;
+    sub->query.params = param_count ? values : NULL;
+    sub->query.param_count = param_count;
+    sub->mailbox = mailbox;
+    sub->submit_cb = submit_cb;
+    sub->data = data;
+
+    // close_remote waits for submitters that got past the check, so nothing
+    // lands on the stack after it has been drained for the last time
+    struct pquv_remote *remote = pool->remote;
+    atomic_fetch_add(&remote->submitters, 1);
+    if (atomic_load(&remote->closed))
+    {
+        atomic_fetch_sub(&remote->submitters, 1);
+        mem_free(sub);
+        LOG_ERROR("Pool is shutting down");
+        return -1;
+    }
+
+    // The mailbox holds its loop open until the result is back
+    if (mailbox && mailbox->pending++ == 0)
+    {
+        uv_ref((uv_handle_t *)&mailbox->async);
+    }
+
+    push_submission(&remote->head, sub);
+    uv_async_send(&remote->async);
+    atomic_fetch_sub(&remote->submitters, 1);
+    return 0;
+}
+
+pquv_mailbox_t *pquv_mailbox_create(uv_loop_t *loop)
+{
+    if (!loop)
+    {
+        LOG_ERROR("loop is NULL");
+        return NULL;
+    }
+
+    pquv_mailbox_t *mailbox = mem_calloc(1, sizeof(pquv_mailbox_t));
+    if (!mailbox)
+    {
+        LOG_ERROR("Failed to allocate memory");
+        return NULL;
+    }
+
+    int init_result = uv_async_init(loop, &mailbox->async, on_mailbox);
+    if (init_result != 0)
+    {
+        LOG_ERROR("uv_async_init failed: %s", uv_strerror(init_result));
+        mem_free(mailbox);
+        return NULL;
+    }
+    mailbox->async.data = mailbox;
+    uv_unref((uv_handle_t *)&mailbox->async);
+    return mailbox;
+}
+
+// Handles allocated apart from their owner are freed once closed
+static void on_detached_closed(uv_handle_t *handle)
+{
+    mem_free(handle->data);
+}
+
+void pquv_mailbox_destroy(pquv_mailbox_t *mailbox)
+{
+    if (!mailbox || mailbox->closing)
+        return;
+
+    // Outstanding results still land here, the last one closes the handle
+    mailbox->closing = 1;
+    if (mailbox->pending == 0)
+    {
+        uv_close((uv_handle_t *)&mailbox->async, on_detached_closed);
+    }
+}
+
+static void push_submission(_Atomic(struct pquv_submission *) *head, struct pquv_submission *sub)
+{
+    struct pquv_submission *old = atomic_load_explicit(head, memory_order_relaxed);
+    do
+    {
+        sub->link = old;
+    } while (!atomic_compare_exchange_weak_explicit(head, &old, sub, memory_order_release, memory_order_relaxed));
+}
+
+// Take everything pushed so far, oldest first
+static struct pquv_submission *take_submissions(_Atomic(struct pquv_submission *) *head)
+{
+    struct pquv_submission *sub = atomic_exchange_explicit(head, NULL, memory_order_acquire);
+    struct pquv_submission *ordered = NULL;
+    while (sub)
+    {
+        struct pquv_submission *next = sub->link;
+        sub->link = ordered;
+        ordered = sub;
+        sub = next;
+    }
+    return ordered;
+}
+
+static void on_submit_result(pg_async_t *pg, PGresult *result, void *data)
+{
+    (void)result;
+    struct pquv_submission *sub = (struct pquv_submission *)data;
+    if (sub->result)
+    {
+        PQclear(sub->result);
+    }
+    sub->status = pquv_query_status(pg);
+    sub->result = pquv_keep_result(pg);
+}
+
+static void on_submit_release(pg_query_t *query)
+{
+    complete_submission((struct pquv_submission *)query);
+}
+
+// libuv coalesces wakeups, each one queues everything submitted since the
+// last so idle connections start with the whole batch
+static void on_submit(uv_async_t *handle)
+{
+    struct pquv_remote *remote = (struct pquv_remote *)handle->data;
+    if (remote->pool && !atomic_load(&remote->closed))
+    {
+        drain_submissions(remote->pool, PQUV_STATUS_OK);
+    }
+}
+
+// Queue waiting submissions, or complete them with status if it is not OK
+static void drain_submissions(pquv_pool_t *pool, pquv_status_t status)
+{
+    struct pquv_submission *sub = take_submissions(&pool->remote->head);
+    if (!sub)
+        return;
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->conns[i])
+        {
+            pool->conns[i]->hold_start++;
+        }
+    }
+
+    while (sub)
+    {
+        struct pquv_submission *next = sub->link;
+        sub->query.result_cb = on_submit_result;
+        sub->query.release_cb = on_submit_release;
+        sub->query.data = sub;
+        sub->status = status;
+
+        if (status != PQUV_STATUS_OK)
+        {
+            complete_submission(sub);
+        }
+        else if (pquv_pool_queue_query(pool, &sub->query) != 0)
+        {
+            sub->status = PQUV_STATUS_ERROR;
+            complete_submission(sub);
+        }
+        sub = next;
+    }
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        pg_async_t *pg = pool->conns[i];
+        if (pg && --pg->hold_start == 0 && pg->is_connected && !pg->is_executing && pg->query_queue)
+        {
+            pquv_execute(pg);
+        }
+    }
+}
+
+// Hand the outcome to the submitter's loop, or report it right here
+static void complete_submission(struct pquv_submission *sub)
+{
+    pquv_mailbox_t *mailbox = sub->mailbox;
+    if (mailbox)
+    {
+        push_submission(&mailbox->head, sub);
+        uv_async_send(&mailbox->async);
+        return;
+    }
+
+    sub->submit_cb(sub->result, sub->status, sub->data);
+    PQclear(sub->result);
+    mem_free(sub);
+}
+
+static void on_mailbox(uv_async_t *handle)
+{
+    pquv_mailbox_t *mailbox = (pquv_mailbox_t *)handle->data;
+    struct pquv_submission *sub = take_submissions(&mailbox->head);
+    while (sub)
+    {
+        struct pquv_submission *next = sub->link;
+        if (!mailbox->closing)
+        {
+            sub->submit_cb(sub->result, sub->status, sub->data);
+        }
+        PQclear(sub->result);
+        mem_free(sub);
+        mailbox->pending--;
+        sub = next;
+    }
+
+    if (mailbox->pending == 0)
+    {
+        if (mailbox->closing)
+        {
+            uv_close((uv_handle_t *)&mailbox->async, on_detached_closed);
+        }
+        else
+        {
+            uv_unref((uv_handle_t *)&mailbox->async);
+        }
+    }
+}
+
+static void on_remote_closed(uv_handle_t *handle)
+{
+    struct pquv_remote *remote = (struct pquv_remote *)handle->data;
+    if (remote->pool)
+    {
+        remote->handle_closed = 1;
+        return;
+    }
+    mem_free(remote);
+}
+
+// Refuse further submissions, then queue what was submitted so far, or
+// complete it with status if that is not OK
+static void close_remote(pquv_pool_t *pool, pquv_status_t status)
+{
+    struct pquv_remote *remote = pool->remote;
+    if (!remote || atomic_load(&remote->closed))
+        return;
+
+    // A submitter that saw the stack open is only pushing and waking the
+    // loop, so this wait is short
+    atomic_store(&remote->closed, 1);
+    while (atomic_load(&remote->submitters) > 0)
+    {
+    }
+
+    drain_submissions(pool, status);
+    uv_close((uv_handle_t *)&remote->async, on_remote_closed);
+}
+
+// The submission state stays until its async handle is closed as well
+static void free_pool(pquv_pool_t *pool)
+{
+    struct pquv_remote *remote = pool->remote;
+    if (remote)
+    {
+        if (remote->handle_closed)
+        {
+            mem_free(remote);
+        }
+        else
+        {
+            remote->pool = NULL;
+        }
+    }
+    mem_free(pool->conns);
+    mem_free(pool);
+}
+
+pquv_tx_t *pquv_tx_begin(pquv_pool_t *pool, const char *begin_sql)
+{
+    if (!pool || pool->destroying || pool->shutting_down)
+    {
+        LOG_ERROR("Invalid parameters");
+        return NULL;
+    }
+
+    pg_async_t *pg = select_connection(pool, 0);
+    if (!pg || accepting_queries(pg, "pquv_tx_begin") != 0)
+    {
+        return NULL;
+    }
+
+    pquv_tx_t *tx = mem_calloc(1, sizeof(pquv_tx_t));
+    if (!tx)
+    {
+        LOG_ERROR("Failed to allocate transaction");
+        return NULL;
+    }
+
+    // Everything waits for the commit so it can go out in one batch
+    tx->pg = pg;
+    tx->held = 1;
+    pg->tx = tx;
+    pg->hold_start++;
+
+    tx->begin = queue_tx_query(tx, begin_sql ? begin_sql : "BEGIN", 0, NULL, NULL, NULL);
+    if (!tx->begin)
+    {
+        pg->tx = NULL;
+        release_tx_hold(tx);
+        mem_free(tx);
+        return NULL;
+    }
+
+    return tx;
+}
+
+int pquv_tx_queue(pquv_tx_t *tx,
+                  const char *sql,
+                  int param_count,
+                  const char **params,
+                  pg_result_cb_t result_cb,
+                  void *query_data)
+{
+    if (!tx || !sql || tx->end)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    if (!tx->pg || tx->lost || tx->failed)
+    {
+        LOG_WARN("Transaction has failed");
+        return -1;
+    }
+
+    if (accepting_queries(tx->pg, "pquv_tx_queue") != 0)
+    {
+        return -1;
+    }
+
+    return queue_tx_query(tx, sql, param_count, params, result_cb, query_data) ? 0 : -1;
+}
+
+int pquv_tx_commit(pquv_tx_t *tx, pquv_tx_cb_t done_cb, void *data)
+{
+    if (!tx || tx->end)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    tx->done_cb = done_cb;
+    tx->data = data;
+    if (!tx->pg || tx->lost)
+    {
+        finish_tx(tx, tx->lost ? tx->lost : PQUV_STATUS_CANCELLED);
+        return 0;
+    }
+
+    // A transaction that failed while it was being built rolls back instead
+    tx->end = queue_tx_query(tx, tx->failed ? "ROLLBACK" : "COMMIT", 0, NULL, NULL, NULL);
+    if (!tx->end)
+    {
+        return -1;
+    }
+    tx->rolling_back = tx->failed;
+
+    release_tx_hold(tx);
+    return 0;
+}
+
+int pquv_tx_rollback(pquv_tx_t *tx, pquv_tx_cb_t done_cb, void *data)
+{
+    if (!tx || tx->end)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    tx->done_cb = done_cb;
+    tx->data = data;
+    if (!tx->pg || tx->lost)
+    {
+        finish_tx(tx, tx->lost ? tx->lost : PQUV_STATUS_CANCELLED);
+        return 0;
+    }
+
+    // Statements still queued are not sent, and if BEGIN was not sent either
+    // there is nothing to roll back
+    int begun = !tx->begin || tx->begin->sent_at;
+    drop_tx_queries(tx->pg, PQUV_STATUS_ABORTED, NULL);
+    if (!begun)
+    {
+        finish_tx(tx, PQUV_STATUS_ABORTED);
+        return 0;
+    }
+
+    tx->end = queue_tx_query(tx, "ROLLBACK", 0, NULL, NULL, NULL);
+    if (!tx->end)
+    {
+        return -1;
+    }
+    tx->rolling_back = 1;
+
+    release_tx_hold(tx);
+    return 0;
+}
+
+static pg_query_t *queue_tx_query(pquv_tx_t *tx, const char *sql, int param_count, const char **params,
+                                  pg_result_cb_t result_cb, void *query_data)
+{
+    pg_query_t *query = create_query(tx->pg, sql, param_count, NULL, (const char *const *)params,
+                                     NULL, NULL, result_cb, query_data);
+    if (!query)
+    {
+        return NULL;
+    }
+
+    query->flags |= QUERY_TX;
+    enqueue_query(tx->pg, query);
+    return query;
+}
+
+static void release_tx_hold(pquv_tx_t *tx)
+{
+    if (!tx->held)
+        return;
+
+    tx->held = 0;
+    pg_async_t *pg = tx->pg;
+    if (pg && --pg->hold_start == 0 && pg->is_connected && !pg->is_executing && !pg->destroying && pg->query_queue)
+    {
+        pquv_execute(pg);
+    }
+}
+
+// The transaction's statements wait at the head of the queue until it is
+// committed or rolled back, whatever was queued ahead of them still runs
+static int tx_held(const pg_async_t *pg)
+{
+    return pg->tx && pg->tx->held && pg->query_queue && (pg->query_queue->flags & QUERY_TX);
+}
+
+// Fail the transaction's queued statements, except keep
+static void drop_tx_queries(pg_async_t *pg, pquv_status_t status, pg_query_t *keep)
+{
+    pg_query_t *dropped = NULL;
+    pg_query_t **dropped_tail = &dropped;
+    pg_query_t *prev = NULL;
+    pg_query_t *query = pg->query_queue;
+
+    // Detach them first, the callbacks below may queue new work
+    while (query)
+    {
+        pg_query_t *next = query->next;
+        if ((query->flags & QUERY_TX) && query != keep)
+        {
+            if (prev)
+                prev->next = next;
+            else
+                pg->query_queue = next;
+            if (pg->query_queue_tail == query)
+                pg->query_queue_tail = prev;
+            pg->queued--;
+            pg->queued_bytes -= query->bytes;
+
+            query->next = NULL;
+            *dropped_tail = query;
+            dropped_tail = &query->next;
+        }
+        else
+        {
+            prev = query;
+        }
+        query = next;
+    }
+
+    check_watermarks(pg);
+    while (dropped)
+    {
+        pg_query_t *next = dropped->next;
+        fail_query(pg, dropped, status);
+        dropped = next;
+    }
+}
+
+// Called as each statement of the transaction completes
+static void tx_step(pg_async_t *pg, pg_query_t *query)
+{
+    pquv_tx_t *tx = pg->tx;
+    int failed = (query->flags & QUERY_FAILED) != 0;
+    if (query == tx->begin)
+    {
+        tx->begin = NULL;
+    }
+
+    if (query != tx->end)
+    {
+        // Skip the rest, and end with a ROLLBACK if the COMMIT has not gone out
+        if (failed && !tx->failed && !tx->lost)
+        {
+            // An unsent COMMIT fails with the rest, which queues the
+            // ROLLBACK below
+            tx->failed = 1;
+            drop_tx_queries(pg, PQUV_STATUS_ABORTED,
+                            tx->end && (tx->rolling_back || tx->end->sent_at) ? tx->end : NULL);
+        }
+        return;
+    }
+
+    if (tx->lost)
+    {
+        finish_tx(tx, tx->lost);
+    }
+    else if (!failed)
+    {
+        finish_tx(tx, tx->rolling_back ? PQUV_STATUS_ABORTED : PQUV_STATUS_OK);
+    }
+    else if (tx->rolling_back)
+    {
+        LOG_WARN("ROLLBACK failed");
+        finish_tx(tx, PQUV_STATUS_ERROR);
+    }
+    else
+    {
+        // The COMMIT was skipped in the pipeline or failed, leave the
+        // transaction before anything else runs on this session
+        pg_query_t *rollback = create_query(pg, "ROLLBACK", 0, NULL, NULL, NULL, NULL, NULL, NULL);
+        if (!rollback)
+        {
+            finish_tx(tx, PQUV_STATUS_ERROR);
+            return;
+        }
+        rollback->flags |= QUERY_TX;
+        push_query(pg, rollback);
+        tx->end = rollback;
+        tx->rolling_back = 1;
+    }
+}
+
+// The session ended, nothing queued for the transaction may run on the next one
+static void tx_lost(pg_async_t *pg, pquv_status_t status)
+{
+    pquv_tx_t *tx = pg->tx;
+    if (!tx)
+        return;
+
+    if (!tx->lost)
+    {
+        tx->lost = status;
+    }
+    drop_tx_queries(pg, status, NULL);
+}
+
+// Unpin the connection and report the outcome
+static void finish_tx(pquv_tx_t *tx, pquv_status_t status)
+{
+    release_tx_hold(tx);
+    if (tx->pg)
+    {
+        tx->pg->tx = NULL;
+    }
+
+    pquv_tx_cb_t done_cb = tx->done_cb;
+    void *data = tx->data;
+    mem_free(tx);
+    if (done_cb)
+    {
+        done_cb(status, data);
+    }
+}
+
+// Pick by the pool's balancing policy among the connections of one role.
+// Queries only wait on a connection that is still connecting if none is
+// ready yet, and read-only ones only go to a primary if no replica is usable.
+static pg_async_t *select_connection(pquv_pool_t *pool, int read_only)
+{
+    pg_async_t *target = NULL;
+    uint64_t best = 0;
+    for (int role = read_only ? PQUV_ROLE_REPLICA : PQUV_ROLE_PRIMARY; role >= PQUV_ROLE_PRIMARY && !target; role--)
+    {
+        for (int pass = 0; pass < 2 && !target; pass++)
+        {
+            for (int i = 0; i < pool->size; i++)
+            {
+                pg_async_t *pg = pool->conns[(pool->next + i) % pool->size];
+                if (!pg || pg->tx || pg->unhealthy || (int)pg->role != role ||
+                    (pass == 0 ? !pg->is_connected : !(pg->is_connecting || pg->reconnect_at)))
+                    continue;
+
+                uint64_t cost = pg->queued + pg->in_flight;
+                if (pool->balance == PQUV_BALANCE_ROUND_ROBIN)
+                {
+                    cost = 0;
+                }
+                else if (pool->balance == PQUV_BALANCE_LEAST_LATENCY)
+                {
+                    cost = (cost + 1) * (pg->latency_usec + 1);
+                }
+
+                if (!target || cost < best)
+                {
+                    target = pg;
+                    best = cost;
+                    if (cost == 0)
+                        break;
+                }
+            }
+        }
+    }
+
+    if (!target)
+    {
+        LOG_WARN(read_only ? "No usable connection in pool" : "No usable primary connection in pool");
+        return NULL;
+    }
+
+    pool->next = (pool->next + 1) % pool->size;
+    return target;
+}
+
+int pquv_pool_set_balance(pquv_pool_t *pool, pquv_balance_t balance)
+{
+    if (!pool || balance < PQUV_BALANCE_LEAST_LOAD || balance > PQUV_BALANCE_LEAST_LATENCY)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    pool->balance = balance;
+    return 0;
+}
+
+int pquv_pool_set_health_check(pquv_pool_t *pool, unsigned int interval_ms)
+{
+    if (!pool || pool->destroying || pool->shutting_down)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    if (interval_ms == 0)
+    {
+        close_health(pool);
+        return 0;
+    }
+
+    if (!pool->health)
+    {
+        struct pquv_health *health = mem_calloc(1, sizeof(struct pquv_health));
+        if (!health)
+        {
+            LOG_ERROR("Failed to allocate memory");
+            return -1;
+        }
+
+        int init_result = uv_timer_init(pool->loop, &health->timer);
+        if (init_result != 0)
+        {
+            LOG_ERROR("uv_timer_init failed: %s", uv_strerror(init_result));
+            mem_free(health);
+            return -1;
+        }
+
+        // Checking does not keep the loop alive by itself
+        health->timer.data = health;
+        health->pool = pool;
+        uv_unref((uv_handle_t *)&health->timer);
+        pool->health = health;
+    }
+
+    pool->health->interval_ms = interval_ms;
+    uv_timer_start(&pool->health->timer, on_health_timer, 0, interval_ms);
+    return 0;
+}
+
+static void on_health_timer(uv_timer_t *handle)
+{
+    struct pquv_health *health = (struct pquv_health *)handle->data;
+    pquv_pool_t *pool = health->pool;
+    for (int i = 0; i < pool->size; i++)
+    {
+        pg_async_t *pg = pool->conns[i];
+
+        // A check inside a transaction would run in it
+        if (pg && pg->is_connected && !pg->health_sent && !pg->tx && !pg->shutting_down)
+        {
+            queue_health_check(pg, 0);
+        }
+    }
+}
+
+static void queue_health_check(pg_async_t *pg, int front)
+{
+    pg_query_t *query = create_query(pg, "SELECT pg_is_in_recovery()", 0, NULL, NULL, NULL, NULL, NULL, NULL);
+    if (!query)
+    {
+        return;
+    }
+    query->flags |= QUERY_INTERNAL | QUERY_HEALTH;
+    pg->health_sent = uv_hrtime();
+
+    if (front)
+    {
+        push_query(pg, query);
+    }
+    else
+    {
+        enqueue_query(pg, query);
+    }
+}
+
+static void health_result(pg_async_t *pg, PGresult *result)
+{
+    uint64_t usec = (uv_hrtime() - pg->health_sent) / 1000;
+    pg->latency_usec = pg->latency_usec ? (pg->latency_usec * 7 + usec) / 8 : usec;
+
+    int unhealthy = 1;
+    if (PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result) == 1)
+    {
+        pg->in_recovery = PQgetvalue(result, 0, 0)[0] == 't';
+        unhealthy = pg->in_recovery != (pg->role == PQUV_ROLE_REPLICA);
+    }
+
+    if (unhealthy != pg->unhealthy)
+    {
+        if (unhealthy)
+        {
+            LOG_WARN("%s connection failed its health check: %s", pg->role == PQUV_ROLE_REPLICA ? "Replica" : "Primary",
+                     PQresultStatus(result) == PGRES_TUPLES_OK ? (pg->in_recovery ? "in recovery" : "not in recovery")
+                                                               : PQresultErrorMessage(result));
+        }
+        else
+        {
+            LOG_INFO("Connection is healthy again");
+        }
+        pg->unhealthy = unhealthy;
+    }
+}
+
+static void close_health(pquv_pool_t *pool)
+{
+    if (!pool->health)
+        return;
+
+    uv_close((uv_handle_t *)&pool->health->timer, on_detached_closed);
+    pool->health = NULL;
+}
+
+int pquv_pool_set_cache(pquv_pool_t *pool, pquv_cache_t *cache)
+{
+    if (!pool)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->conns[i])
+        {
+            pool->conns[i]->cache = cache;
+        }
+    }
+    return 0;
+}
+
+int pquv_pool_queue_cached(pquv_pool_t *pool,
+                           const char *sql,
+                           int param_count,
+                           const char **params,
+                           pg_result_cb_t result_cb,
+                           void *query_data)
+{
+    if (!pool || !sql || pool->destroying || pool->shutting_down)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    pg_async_t *target = select_connection(pool, 1);
+    if (!target)
+    {
+        return -1;
+    }
+
+    return pquv_queue_cached(target, sql, param_count, params, result_cb, query_data);
+}
+
+// Members running queries refuse settings that change how they send, the
+// pool checks them all before changing any
+static int pool_executing(const pquv_pool_t *pool)
+{
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->conns[i] && pool->conns[i]->is_executing)
+            return 1;
+    }
+    return 0;
+}
+
+// Set pipeline mode on every connection in the pool
+int pquv_pool_set_pipeline(pquv_pool_t *pool, int max_in_flight)
+{
+    if (!pool || pool->shutting_down || max_in_flight < 0)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    if (pool_executing(pool))
+    {
+        LOG_ERROR("Cannot change pipeline mode while executing");
+        return -1;
+    }
+
+    // Leaving pipeline mode is the only step that can still fail. Members
+    // that left keep their window and enter it again on the next send.
+    for (int i = 0; i < pool->size && max_in_flight == 0; i++)
+    {
+        pg_async_t *pg = pool->conns[i];
+        if (pg && pg->in_pipeline)
+        {
+            if (!PQexitPipelineMode(pg->conn))
+            {
+                LOG_ERROR("PQexitPipelineMode failed: %s", PQerrorMessage(pg->conn));
+                return -1;
+            }
+            pg->in_pipeline = 0;
+        }
+    }
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->conns[i])
+        {
+            pquv_set_pipeline(pool->conns[i], max_in_flight);
+        }
+    }
+
+    return 0;
+}
+
+// Set the coalescing window on every connection in the pool
+int pquv_pool_set_coalesce(pquv_pool_t *pool, int max_queries, unsigned int window_usec)
+{
+    if (!pool || pool->shutting_down || max_queries < 0)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->conns[i])
+        {
+            pquv_set_coalesce(pool->conns[i], max_queries, window_usec);
+        }
+    }
+
+    return 0;
+}
+
+// Set the statement cache size on every connection in the pool
+int pquv_pool_set_statement_cache(pquv_pool_t *pool, int capacity)
+{
+    if (!pool || pool->shutting_down || capacity < 0)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    if (pool_executing(pool))
+    {
+        LOG_ERROR("Cannot change the cache while executing");
+        return -1;
+    }
+
+    // Allocate every cache before replacing any, so a failure leaves all
+    // members as they were
+    pg_stmt_t **caches = mem_calloc(pool->size, sizeof(pg_stmt_t *));
+    if (!caches)
+    {
+        LOG_ERROR("Failed to allocate cache");
+        return -1;
+    }
+
+    for (int i = 0; i < pool->size && capacity > 0; i++)
+    {
+        if (pool->conns[i] && !(caches[i] = mem_calloc(capacity, sizeof(pg_stmt_t))))
+        {
+            LOG_ERROR("Failed to allocate cache");
+            for (int j = 0; j < i; j++)
+            {
+                mem_free(caches[j]);
+            }
+            mem_free(caches);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->conns[i])
+        {
+            replace_statement_cache(pool->conns[i], caches[i], capacity);
+        }
+    }
+
+    mem_free(caches);
+    return 0;
+}
+
+// Set the query timeout on every connection in the pool
+int pquv_pool_set_timeout(pquv_pool_t *pool, unsigned int timeout_ms)
+{
+    if (!pool || pool->shutting_down)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->conns[i])
+        {
+            pquv_set_timeout(pool->conns[i], timeout_ms);
+        }
+    }
+
+    return 0;
+}
+
+int pquv_pool_set_reconnect(pquv_pool_t *pool, unsigned int min_ms, unsigned int max_ms, int max_attempts)
+{
+    if (!pool || pool->shutting_down || max_attempts < 0 || (min_ms && max_ms < min_ms))
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->conns[i])
+        {
+            pquv_set_reconnect(pool->conns[i], min_ms, max_ms, max_attempts);
+        }
+    }
+
+    return 0;
+}
+
+int pquv_pool_set_queue_limit(pquv_pool_t *pool,
+                              int max_queries,
+                              size_t max_bytes,
+                              pquv_overflow_t overflow,
+                              pquv_queue_full_cb_t queue_full_cb,
+                              void *data)
+{
+    if (!pool || pool->shutting_down || max_queries < 0 || (overflow == PQUV_OVERFLOW_CALLBACK && !queue_full_cb))
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    pool->max_queued = max_queries;
+    pool->max_queued_bytes = max_bytes;
+    pool->overflow = overflow;
+    pool->queue_full_cb = queue_full_cb;
+    pool->queue_full_data = data;
+    return 0;
+}
+
+int pquv_pool_set_watermarks(pquv_pool_t *pool, int high, int low, pquv_watermark_cb_t watermark_cb, void *data)
+{
+    if (!pool || pool->shutting_down || high < 0 || (high > 0 && (low < 0 || low >= high || !watermark_cb)))
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    pool->high_watermark = high;
+    pool->low_watermark = low;
+    pool->above_watermark = 0;
+    pool->watermark_cb = watermark_cb;
+    pool->watermark_data = data;
+    return 0;
+}
+
+int pquv_pool_set_trace(pquv_pool_t *pool, pquv_trace_cb_t trace_cb, void *data)
+{
+    if (!pool || pool->shutting_down)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->conns[i])
+        {
+            pquv_set_trace(pool->conns[i], trace_cb, data);
+        }
+    }
+
+    return 0;
+}
+
+int pquv_pool_stats(const pquv_pool_t *pool, pquv_stats_t *out)
+{
+    if (!pool || !out)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < pool->size; i++)
+    {
+        pquv_stats_t conn;
+        if (!pool->conns[i] || pquv_stats(pool->conns[i], &conn) != 0)
+            continue;
+
+        out->queued += conn.queued;
+        out->sent += conn.sent;
+        out->completed += conn.completed;
+        out->errors += conn.errors;
+        out->failed += conn.failed;
+        out->reconnects += conn.reconnects;
+        out->replayed += conn.replayed;
+        out->rejected += conn.rejected;
+        out->cache_hits += conn.cache_hits;
+        out->queue_depth += conn.queue_depth;
+        out->in_flight += conn.in_flight;
+        hist_merge(&out->queue_wait, &conn.queue_wait);
+        hist_merge(&out->first_byte, &conn.first_byte);
+        hist_merge(&out->execution, &conn.execution);
+        hist_merge(&out->total, &conn.total);
+    }
+
+    return 0;
+}
+
+// Shut down every connection, the pool is freed with the last one
+int pquv_pool_shutdown(pquv_pool_t *pool, int graceful, unsigned int timeout_ms)
+{
+    if (!pool || pool->destroying || pool->shutting_down)
+    {
+        LOG_ERROR("Invalid parameters");
+        return -1;
+    }
+
+    // Work submitted so far drains with the rest, or is discarded
+    close_remote(pool, graceful ? PQUV_STATUS_OK : PQUV_STATUS_SHUTDOWN);
+    close_health(pool);
+
+    // The extra reference keeps the pool alive while members are destroyed
+    // synchronously below
+    pool->shutting_down = 1;
+    pool->live = 1;
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->conns[i])
+        {
+            pool->live++;
+        }
+    }
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->conns[i])
+        {
+            shutdown_context(pool->conns[i], graceful, timeout_ms);
+        }
+    }
+
+    if (--pool->live == 0)
+    {
+        free_pool(pool);
+    }
+
+    return 0;
+}
+
+// Close every connection and free the pool
+void pquv_pool_destroy(pquv_pool_t *pool)
+{
+    if (!pool || pool->destroying)
+        return;
+
+    // Discarded queries are reported, their callbacks must not queue more
+    pool->destroying = 1;
+    close_remote(pool, PQUV_STATUS_CANCELLED);
+    close_health(pool);
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        pg_async_t *pg = pool->conns[i];
+        if (pg)
+        {
+            pg->pool = NULL;
+            pg_async_destroy(pg);
+        }
+    }
+
+    free_pool(pool);
+}
+
+// Cancel current operations and cleanup
+static void pg_async_cancel(pg_async_t *pg)
+{
+    if (!pg)
+        return;
+
+    // Stop the handle, it is closed by pg_async_destroy
+    if (pg->is_executing)
+    {
+        set_poll_events(pg, 0);
+    }
+
+    // A shutdown runs on the loop and can cancel in the background, an
+    // explicit destroy may happen after the loop stopped and blocks instead
+    if (pg->conn && pg->is_executing && pg->shutting_down)
+    {
+        start_cancel(pg);
+    }
+    else if (pg->conn && pg->is_executing)
+    {
+        PGcancel *cancel = PQgetCancel(pg->conn);
+        if (cancel)
+        {
+            char errbuf[256];
+            PQcancel(cancel, errbuf, sizeof(errbuf));
+            PQfreeCancel(cancel);
+        }
+    }
+
+    // A borrowed connection is handed back with its COPY aborted
+    if (pg->copy_state == COPY_IN && !pg->owns_connection)
+    {
+        PQputCopyEnd(pg->conn, "COPY cancelled");
+        PQflush(pg->conn);
+    }
+    reset_copy(pg);
+
+    pg->is_executing = 0;
+
+    // Every discarded query still gets its callback
+    pquv_status_t status = pg->shutting_down ? PQUV_STATUS_SHUTDOWN : PQUV_STATUS_CANCELLED;
+    fail_in_flight(pg, status);
+    fail_queued(pg, status);
+
+    // A transaction that was never ended outlives the context
+    if (pg->tx)
+    {
+        tx_lost(pg, status);
+        if (pg->tx)
+        {
+            pg->tx->pg = NULL;
+            pg->tx = NULL;
+        }
+    }
+}
+
+// Destroy context and free resources
+static void pg_async_destroy(pg_async_t *pg)
+{
+    if (!pg || pg->destroying)
+        return;
+
+    // Callbacks of the queries cancelled below can no longer queue
+    pg->destroying = 1;
+    pg_async_cancel(pg);
+
+    // Hand a borrowed connection back outside pipeline mode
+    if (pg->in_pipeline && !pg->owns_connection)
+    {
+        PQexitPipelineMode(pg->conn);
+        pg->in_pipeline = 0;
+    }
+    if (!pg->owns_connection && !pg->was_nonblocking)
+    {
+        PQsetnonblocking(pg->conn, 0);
+    }
+
+    // A cancel request in progress finishes on its own
+    if (pg->cancel)
+    {
+        pg->cancel->pg = NULL;
+        pg->cancel = NULL;
+    }
+
+    // Close every handle, the context is freed once the last one is closed
+    if (pg->handle_initialized)
+    {
+        close_handle(pg, (uv_handle_t *)&pg->poll);
+    }
+    if (pg->timer_initialized)
+    {
+        close_handle(pg, (uv_handle_t *)&pg->timer);
+    }
+    if (pg->coalesce_initialized)
+    {
+        close_handle(pg, (uv_handle_t *)&pg->coalesce);
+        close_handle(pg, (uv_handle_t *)&pg->coalesce_spin);
+    }
+
+    if (pg->open_handles == 0)
+    {
+        // No handle initialized, clean up directly
+        free_context(pg);
+    }
+}
+
+static void close_handle(pg_async_t *pg, uv_handle_t *handle)
+{
+    (void)pg;
+    if (!uv_is_closing(handle))
+    {
+        uv_close(handle, on_handle_closed);
+    }
+}
+
+// Handle close callback
+static void on_handle_closed(uv_handle_t *handle)
+{
+    if (!handle || !handle->data)
+        return;
+
+    pg_async_t *pg = (pg_async_t *)handle->data;
+    pg->open_handles--;
+    if (handle == (uv_handle_t *)&pg->poll)
+    {
+        pg->poll_closing = 0;
+    }
+
+    if (pg->destroying)
+    {
+        if (pg->open_handles == 0)
+        {
+            free_context(pg);
+        }
+        return;
+    }
+
+    // The poll was closed because libpq switched sockets while connecting
+    if (handle == (uv_handle_t *)&pg->poll && pg->is_connecting)
+    {
+        if (watch_connect(pg, pg->connect_wait) != 0)
+        {
+            connect_done(pg, -1);
+        }
+    }
+}
+
+// Close the poll of a socket libpq has closed or is about to. Another
+// connection may get the same descriptor, and libuv unregisters it when a
+// poll on it is stopped or closed, so this must happen before the reuse.
+static void close_poll(pg_async_t *pg)
+{
+    if (!pg->handle_initialized)
+        return;
+
+    pg->handle_initialized = 0;
+    pg->poll_closing = 1;
+    close_handle(pg, (uv_handle_t *)&pg->poll);
+}
+
+// Final cleanup
+static void free_context(pg_async_t *pg)
+{
+    if (pg->conn && pg->owns_connection)
+    {
+        PQfinish(pg->conn);
+    }
+    if (pg->error_message)
+    {
+        mem_free(pg->error_message);
+    }
+    for (int i = 0; i < pg->stmt_capacity; i++)
+    {
+        forget_statement(&pg->stmt_cache[i]);
+    }
+    mem_free(pg->stmt_cache);
+
+    while (pg->query_slabs)
+    {
+        struct pquv_slab *next = pg->query_slabs->next;
+        mem_free(pg->query_slabs);
+        pg->query_slabs = next;
+    }
+    while (pg->arena)
+    {
+        struct pquv_arena_block *next = pg->arena->next;
+        mem_free(pg->arena);
+        pg->arena = next;
+    }
+
+    while (pg->listeners)
+    {
+        struct pquv_listener *next = pg->listeners->next;
+        mem_free(pg->listeners);
+        pg->listeners = next;
+    }
+
+    if (pg->pool)
+    {
+        pool_forget(pg);
+    }
+
+    mem_free(pg);
+}
+
+// A pooled connection finished shutting down, the pool goes with the last one
+static void pool_forget(pg_async_t *pg)
+{
+    pquv_pool_t *pool = pg->pool;
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->conns[i] == pg)
+        {
+            pool->conns[i] = NULL;
+        }
+    }
+
+    if (pool->shutting_down && --pool->live == 0)
+    {
+        free_pool(pool);
+    }
+}
+
+// Wait for the socket readiness PQconnectPoll asked for
+static int watch_connect(pg_async_t *pg, PostgresPollingStatusType poll_status)
+{
+    int sock = PQsocket(pg->conn);
+    if (sock < 0)
+    {
+        LOG_ERROR("Invalid socket: %d", sock);
+        return -1;
+    }
+
+    // A uv_poll_t cannot change sockets, rebuild it once it is closed
+    if (pg->handle_initialized && sock != pg->poll_fd)
+    {
+        close_poll(pg);
+    }
+    if (pg->poll_closing)
+    {
+        pg->connect_wait = poll_status;
+        return 0;
+    }
+
+    if (!pg->handle_initialized && init_poll(pg, sock) != 0)
+    {
+        return -1;
+    }
+
+    int events = poll_status == PGRES_POLLING_READING ? UV_READABLE : UV_WRITABLE;
+    int start_result = uv_poll_start(&pg->poll, events, on_connect_poll);
+    if (start_result != 0)
+    {
+        LOG_ERROR("uv_poll_start failed: %s", uv_strerror(start_result));
+        return -1;
+    }
+    pg->poll_events = -1; // Armed for on_connect_poll, not on_poll
+
+    return 0;
+}
+
+// Poll callback while the connection is being established
+static void on_connect_poll(uv_poll_t *handle, int status, int events)
+{
+    (void)events;
+
+    pg_async_t *pg = (pg_async_t *)handle->data;
+
+    // A socket error is reported by PQconnectPoll, which may move on to the
+    // next host address, so poll errors are not treated as fatal here
+    if (status < 0)
+    {
+        LOG_WARN("Poll error: %s", uv_strerror(status));
+    }
+
+    PostgresPollingStatusType poll_status = pg->reconnecting ? PQresetPoll(pg->conn) : PQconnectPoll(pg->conn);
+    switch (poll_status)
+    {
+    case PGRES_POLLING_OK:
+        connect_done(pg, 0);
+        break;
+    case PGRES_POLLING_FAILED:
+        connect_done(pg, -1);
+        break;
+    default:
+        if (watch_connect(pg, poll_status) != 0)
+        {
+            connect_done(pg, -1);
+        }
+        break;
+    }
+}
+
+// Report the connection outcome to the caller. A reconnect is not reported,
+// it resumes the queue or fails it.
+static void connect_done(pg_async_t *pg, int status)
+{
+    int reconnect = pg->reconnecting;
+    pg->is_connecting = 0;
+    pg->reconnecting = 0;
+    set_poll_events(pg, 0);
+
+    if (status == 0 && PQsetnonblocking(pg->conn, 1) != 0)
+    {
+        LOG_WARN("PQsetnonblocking failed: %s", PQerrorMessage(pg->conn));
+        status = -1;
+    }
+
+    if (status == 0)
+    {
+        pg->is_connected = 1;
+        pg->ever_connected = 1;
+        pg->reconnect_attempts = 0;
+    }
+    else
+    {
+        LOG_WARN("Connection failed: %s", PQerrorMessage(pg->conn));
+        close_poll(pg);
+    }
+
+    if (pg->connect_cb && !reconnect)
+    {
+        pg->connect_cb(pg, status, pg->data);
+    }
+
+    if (status != 0)
+    {
+        connect_failed(pg, reconnect);
+        return;
+    }
+
+    // Route nothing by a role the server may no longer have
+    if (pg->pool && pg->pool->health && !pg->health_sent)
+    {
+        queue_health_check(pg, 1);
+    }
+
+    // A new server session has no subscriptions, renew them first
+    if (reconnect)
+    {
+        for (struct pquv_listener *l = pg->listeners; l; l = l->next)
+        {
+            int renewed = 0;
+            for (struct pquv_listener *prev = pg->listeners; prev != l; prev = prev->next)
+            {
+                renewed |= prev->notify_cb && strcmp(prev->channel, l->channel) == 0;
+            }
+            if (l->notify_cb && !renewed)
+            {
+                queue_listen(pg, "LISTEN", l->channel, 1);
+            }
+        }
+    }
+
+    // Persistent contexts start on whatever was queued while connecting,
+    // a reset connection resumes its queue and so does one shutting down
+    if ((pg->persistent || reconnect || pg->shutting_down) && pg->query_queue && !pg->is_executing)
+    {
+        pquv_execute(pg);
+    }
+    else if (pg->persistent && !pg->is_executing)
+    {
+        // Idle from the start, notice if the server closes the connection
+        set_poll_events(pg, UV_READABLE);
+    }
+}
+
+// A connect or reset failed. With a backoff configured, resets of lost
+// connections and of pool members are retried and the queue waits.
+static void connect_failed(pg_async_t *pg, int reconnect)
+{
+    if ((reconnect || pg->pool) && schedule_reconnect(pg) == 0)
+        return;
+
+    // Nothing queued while connecting can run
+    fail_queued(pg, PQUV_STATUS_DISCONNECTED);
+
+    // Keep failed pool members so the pool array stays stable, and
+    // persistent contexts that lost an established connection
+    if ((pg->pool || (reconnect && pg->persistent)) && !pg->shutting_down)
+    {
+        if (pg->pool && !pg->destroying)
+        {
+            LOG_ERROR("Pooled connection failed, it is left out of the pool");
+        }
+        return;
+    }
+    pg_async_destroy(pg);
+}
+
+// Execute the next query in the queue
+static void execute_next_query(pg_async_t *pg)
+{
+    if (!pg->query_queue)
+    {
+        // All queries completed successfully
+        pg->is_executing = 0;
+
+        // Always auto-cleanup when all queries are done
+        finish_execution(pg);
+        return;
+    }
+
+    // A cancel still on its way could hit the next query instead of the one
+    // that expired, the queue waits for it in cancel_done
+    if (pg->cancel && !pg->current_query)
+    {
+        set_poll_events(pg, UV_READABLE);
+        return;
+    }
+
+    // Queries that could not be sent have already been reported, keep going
+    // until something is in flight
+    while (pg->query_queue && !pg->current_query && !tx_held(pg))
+    {
+        int result;
+        if (pg->pipeline_window > 0)
+        {
+            result = send_pipeline(pg);
+        }
+        else
+        {
+            result = prepare_statement(pg) != 0 ? -1 : send_query(pg, pop_query(pg));
+        }
+
+        if (result != 0)
+        {
+            handle_error(pg, PQerrorMessage(pg->conn));
+            return;
+        }
+    }
+
+    if (!pg->current_query)
+    {
+        finish_execution(pg);
+        return;
+    }
+
+    int sock = PQsocket(pg->conn);
+
+    if (sock < 0)
+    {
+        LOG_ERROR("Invalid socket: %d", sock);
+        handle_error(pg, "Invalid PostgreSQL socket");
+        return;
+    }
+
+    if (!pg->handle_initialized && init_poll(pg, sock) != 0)
+    {
+        handle_error(pg, "Failed to initialize poll handle");
+        return;
+    }
+
+    if (watch_output(pg) != 0)
+    {
+        handle_error(pg, PQerrorMessage(pg->conn));
+        return;
+    }
+}
+
+// Watch the libpq socket, libuv polls sockets on Windows as well
+static int init_poll(pg_async_t *pg, int sock)
+{
+#ifdef _WIN32
+    int init_result = uv_poll_init_socket(pg->loop, &pg->poll, (uv_os_sock_t)sock);
+#else
+    int init_result = uv_poll_init(pg->loop, &pg->poll, sock);
+#endif
+    if (init_result != 0)
+    {
+        LOG_ERROR("uv_poll_init failed: %s", uv_strerror(init_result));
+        return -1;
+    }
+
+    pg->poll.data = pg;
+    pg->poll_fd = sock;
+    pg->poll_events = 0;
+    pg->handle_initialized = 1;
+    pg->open_handles++;
+    return 0;
+}
+
+// Push buffered output to the server without blocking
+static int flush_output(pg_async_t *pg)
+{
+    int result = PQflush(pg->conn);
+    if (result < 0)
+    {
+        LOG_WARN("PQflush failed: %s", PQerrorMessage(pg->conn));
+        return -1;
+    }
+
+    pg->flushing = result;
+    return 0;
+}
+
+// Flush what was just sent and only watch for writability while output is pending
+static int watch_output(pg_async_t *pg)
+{
+    if (flush_output(pg) != 0)
+    {
+        return -1;
+    }
+
+    return set_poll_events(pg, UV_READABLE | (pg->flushing ? UV_WRITABLE : 0));
+}
+
+// Change what the poll watches, skipping the syscalls when nothing changes
+static int set_poll_events(pg_async_t *pg, int events)
+{
+    if (!pg->handle_initialized || events == pg->poll_events)
+        return 0;
+
+    int result = events ? uv_poll_start(&pg->poll, events, on_poll) : uv_poll_stop(&pg->poll);
+    if (result != 0)
+    {
+        LOG_ERROR("uv_poll_start failed: %s", uv_strerror(result));
+        return -1;
+    }
+
+    pg->poll_events = events;
+    return 0;
+}
+
+// The queue is drained or was cancelled: destroy standalone contexts,
+// keep persistent and pooled ones idle for the next query
+static void finish_execution(pg_async_t *pg)
+{
+    pg->is_executing = 0;
+
+    if (!pg->persistent || pg->shutting_down)
+    {
+        pg_async_destroy(pg);
+        return;
+    }
+
+    // Nothing references copied SQL or parameters any more, and there is no
+    // deadline left to watch
+    if (!pg->query_queue && !pg->current_query)
+    {
+        arena_reset(pg);
+        if (pg->timer_deadline)
+        {
+            uv_timer_stop(&pg->timer);
+            pg->timer_deadline = 0;
+        }
+    }
+
+    if (PQstatus(pg->conn) != CONNECTION_OK)
+    {
+        LOG_WARN("Connection is broken: %s", PQerrorMessage(pg->conn));
+
+        // handle_error has already tried to reset one it marked disconnected
+        if (pg->is_connected)
+        {
+            connection_lost(pg);
+        }
+        else
+        {
+            set_poll_events(pg, 0);
+        }
+        return;
+    }
+
+    // Stay armed for readability while idle so the next query needs no
+    // poll changes and a closed connection is noticed
+    set_poll_events(pg, UV_READABLE);
+}
+
+// Remove the query at the head of the queue
+static pg_query_t *pop_query(pg_async_t *pg)
+{
+    pg_query_t *query = pg->query_queue;
+    pg->query_queue = query->next;
+    if (!pg->query_queue)
+    {
+        pg->query_queue_tail = NULL;
+    }
+    pg->queued--;
+    pg->queued_bytes -= query->bytes;
+    check_watermarks(pg);
+    return query;
+}
+
+// Send a query and append it to the in-flight list
+static int send_query(pg_async_t *pg, pg_query_t *query)
+{
+    // Its PREPARE failed or it timed out, and that has been reported already
+    if (query->flags & QUERY_FAILED)
+    {
+        cleanup_query(pg, query);
+        return 0;
+    }
+
+    // Expired queries are not sent, nor PREPAREs for them
+    uint64_t now = uv_now(pg->loop);
+    pg_query_t *target = (query->flags & QUERY_PREPARE) ? query->owner : query;
+    if ((target->flags & QUERY_FAILED) || (target->deadline && target->deadline <= now))
+    {
+        fail_query(pg, query, PQUV_STATUS_TIMEOUT);
+        return 0;
+    }
+
+    int result;
+    if (query->flags & QUERY_PREPARE)
+    {
+        result = PQsendPrepare(pg->conn,
+                               query->stmt->name,
+                               query->owner->sql,
+                               query->owner->param_count,
+                               query->owner->param_types);
+    }
+    else if (query->stmt)
+    {
+        result = PQsendQueryPrepared(pg->conn,
+                                     query->stmt->name,
+                                     query->param_count,
+                                     (const char **)query->params,
+                                     query->param_lengths,
+                                     query->param_formats,
+                                     query->result_format);
+    }
+    else if (query->param_count > 0 || query->result_format || pg->in_pipeline)
+    {
+        // The simple query protocol is not allowed in pipeline mode and
+        // always returns text
+        result = PQsendQueryParams(pg->conn,
+                                   query->sql,
+                                   query->param_count,
+                                   query->param_types,
+                                   (const char **)query->params,
+                                   query->param_lengths,
+                                   query->param_formats,
+                                   query->result_format);
+    }
+    else
+    {
+        result = PQsendQuery(pg->conn, query->sql);
+    }
+
+    if (!result)
+    {
+        LOG_WARN("Failed to send query: %s", PQerrorMessage(pg->conn));
+        if (PQstatus(pg->conn) == CONNECTION_BAD)
+        {
+            // Back to the queue, handle_error decides what happens to it
+            push_query(pg, query);
+            return -1;
+        }
+
+        // Only this query is affected
+        fail_query(pg, query, PQUV_STATUS_ERROR);
+        return 0;
+    }
+
+    if (!(query->flags & QUERY_INTERNAL))
+    {
+        query->sent_at = uv_hrtime();
+        pg->stats.sent++;
+        hist_record(&pg->stats.queue_wait, query->queued_at, query->sent_at);
+        trace_query(pg, query, PQUV_TRACE_SENT, query->sent_at);
+    }
+
+    query->next = NULL;
+    if (!pg->current_query)
+    {
+        pg->current_query = pg->sent_queue_tail = query;
+        begin_results(pg);
+    }
+    else
+    {
+        pg->sent_queue_tail->next = query;
+        pg->sent_queue_tail = query;
+    }
+    pg->in_flight++;
+
+    return 0;
+}
+
+// Put a query back at the head of the queue
+static void push_query(pg_async_t *pg, pg_query_t *query)
+{
+    query->next = pg->query_queue;
+    pg->query_queue = query;
+    if (!pg->query_queue_tail)
+    {
+        pg->query_queue_tail = query;
+    }
+    pg->queued++;
+    pg->queued_bytes += query->bytes;
+}
+
+// FNV-1a hash of the statement text and parameter types
+static uint64_t hash_statement(const pg_query_t *query)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)query->sql; *p; p++)
+    {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+
+    if (query->param_types)
+    {
+        const unsigned char *p = (const unsigned char *)query->param_types;
+        for (size_t i = 0; i < query->param_count * sizeof(Oid); i++)
+        {
+            hash ^= p[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+// Whether a cached statement was prepared for the query's SQL and types
+static int statement_matches(const pg_stmt_t *stmt, const pg_query_t *query, uint64_t hash)
+{
+    if (stmt->hash != hash || strcmp(stmt->sql, query->sql) != 0)
+        return 0;
+
+    if (!stmt->param_types || !query->param_types)
+        return stmt->param_types == query->param_types;
+
+    return stmt->param_count == query->param_count &&
+           memcmp(stmt->param_types, query->param_types, query->param_count * sizeof(Oid)) == 0;
+}
+
+// Route the parameterized query at the head of the queue through the statement
+// cache. On a miss its PREPARE, and the DEALLOCATE of the least recently used
+// entry when the cache is full, are queued in front of it so they are
+// pipelined ahead of the first execute.
+static int prepare_statement(pg_async_t *pg)
+{
+    pg_query_t *query = pg->query_queue;
+    if (!pg->stmt_capacity || query->param_count <= 0 ||
+        (query->flags & (QUERY_INTERNAL | QUERY_CACHE_CHECKED)))
+    {
+        return 0;
+    }
+    query->flags |= QUERY_CACHE_CHECKED;
+
+    uint64_t hash = hash_statement(query);
+    pg_stmt_t *slot = NULL;
+    pg_stmt_t *lru = NULL;
+    for (int i = 0; i < pg->stmt_capacity; i++)
+    {
+        pg_stmt_t *stmt = &pg->stmt_cache[i];
+        if (!stmt->sql)
+        {
+            if (!slot)
+                slot = stmt;
+            continue;
+        }
+
+        if (statement_matches(stmt, query, hash))
+        {
+            stmt->last_used = ++pg->stmt_clock;
+            query->stmt = stmt;
+            return 0;
+        }
+
+        if (!lru || stmt->last_used < lru->last_used)
+            lru = stmt;
+    }
+
+    // Allocation failures below only mean the query runs unprepared
+    char *sql = mem_strdup(query->sql);
+    Oid *types = NULL;
+    if (query->param_types)
+    {
+        types = mem_alloc(query->param_count * sizeof(Oid));
+        if (types)
+        {
+            memcpy(types, query->param_types, query->param_count * sizeof(Oid));
+        }
+    }
+    if (!sql || (query->param_types && !types))
+    {
+        LOG_ERROR("Failed to allocate cache entry");
+        mem_free(sql);
+        mem_free(types);
+        return 0;
+    }
+
+    pg_query_t *deallocate = NULL;
+    if (!slot)
+    {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "DEALLOCATE %s", lru->name);
+        deallocate = create_query(pg, buf, 0, NULL, NULL, NULL, NULL, NULL, NULL);
+        if (!deallocate)
+        {
+            mem_free(sql);
+            mem_free(types);
+            return 0;
+        }
+        deallocate->flags |= QUERY_INTERNAL;
+    }
+
+    pg_query_t *prepare = alloc_query(pg);
+    if (!prepare)
+    {
+        LOG_ERROR("Failed to allocate cache entry");
+        cleanup_query(pg, deallocate);
+        mem_free(sql);
+        mem_free(types);
+        return 0;
+    }
+
+    if (deallocate)
+    {
+        forget_statement(lru);
+        slot = lru;
+    }
+
+    slot->id = next_statement_id();
+    snprintf(slot->name, sizeof(slot->name), "pquv_%lu", slot->id);
+    slot->sql = sql;
+    slot->param_types = types;
+    slot->param_count = query->param_count;
+    slot->hash = hash;
+    slot->last_used = ++pg->stmt_clock;
+
+    prepare->flags = QUERY_INTERNAL | QUERY_PREPARE;
+    prepare->stmt = slot;
+    prepare->stmt_id = slot->id;
+    prepare->owner = query;
+    query->stmt = slot;
+
+    push_query(pg, prepare);
+    if (deallocate)
+    {
+        push_query(pg, deallocate);
+    }
+
+    return 0;
+}
+
+static void forget_statement(pg_stmt_t *stmt)
+{
+    mem_free(stmt->sql);
+    mem_free(stmt->param_types);
+    memset(stmt, 0, sizeof(*stmt));
+}
+
+// Statement names are unique per process so several contexts can share a
+// borrowed connection one after another
+static uv_once_t statement_once = UV_ONCE_INIT;
+static uv_mutex_t statement_mutex;
+static unsigned long statement_counter;
+
+static void init_statement_mutex(void)
+{
+    uv_mutex_init(&statement_mutex);
+}
+
+static unsigned long next_statement_id(void)
+{
+    uv_once(&statement_once, init_statement_mutex);
+    uv_mutex_lock(&statement_mutex);
+    unsigned long id = ++statement_counter;
+    uv_mutex_unlock(&statement_mutex);
+    return id;
+}
+
+// Send as many queued queries as the pipeline window allows, followed by a sync point
+static int send_pipeline(pg_async_t *pg)
+{
+    if (!pg->in_pipeline)
+    {
+        if (!PQenterPipelineMode(pg->conn))
+        {
+            LOG_ERROR("PQenterPipelineMode failed: %s", PQerrorMessage(pg->conn));
+            return -1;
+        }
+        pg->in_pipeline = 1;
+    }
+
+    int in_flight = pg->in_flight;
+    while (pg->query_queue && pg->in_flight < pg->pipeline_window && !tx_held(pg))
+    {
+        if (prepare_statement(pg) != 0 || send_query(pg, pop_query(pg)) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if (pg->in_flight == in_flight)
+    {
+        return 0;
+    }
+
+    if (!PQpipelineSync(pg->conn))
+    {
+        LOG_WARN("PQpipelineSync failed: %s", PQerrorMessage(pg->conn));
+        return -1;
+    }
+    pg->pending_syncs++;
+
+    return 0;
+}
+
+// Deliver every result that is available without blocking.
+// Returns 1 when nothing is left in flight, 0 when more input is needed
+// and -1 when the context has been torn down.
+static int process_results(pg_async_t *pg)
+{
+    while (pg->current_query || pg->pending_syncs > 0)
+    {
+        // PQgetResult keeps returning the COPY result until the COPY is over
+        if (pg->copy_state != COPY_NONE)
+        {
+            int copy_result = pump_copy(pg);
+            if (copy_result != 1)
+            {
+                return copy_result;
+            }
+        }
+
+        if (PQisBusy(pg->conn))
+        {
+            return 0;
+        }
+
+        PGresult *result = PQgetResult(pg->conn);
+        if (!result && PQstatus(pg->conn) == CONNECTION_BAD)
+        {
+            handle_error(pg, PQerrorMessage(pg->conn));
+            return -1;
+        }
+
+        if (!result)
+        {
+            // The query at the head of the in-flight list has no more results
+            pg_query_t *query = pg->current_query;
+            if (query)
+            {
+                pg->current_query = query->next;
+                if (!pg->current_query)
+                {
+                    pg->sent_queue_tail = NULL;
+                }
+                pg->in_flight--;
+                cleanup_query(pg, query);
+                begin_results(pg);
+            }
+            continue;
+        }
+
+        ExecStatusType result_status = PQresultStatus(result);
+
+        if (result_status == PGRES_PIPELINE_SYNC)
+        {
+            // A pipeline segment is complete, refill the window
+            PQclear(result);
+            pg->pending_syncs--;
+            if (pg->row_mode_pending)
+            {
+                begin_results(pg);
+            }
+            if (pg->query_queue && !pg->cancel && (send_pipeline(pg) != 0 || watch_output(pg) != 0))
+            {
+                handle_error(pg, PQerrorMessage(pg->conn));
+                return -1;
+            }
+            continue;
+        }
+
+        // Queries skipped after an error earlier in the pipeline are reported
+        // as aborted, errors caused by a lost connection as disconnected
+        pquv_status_t status = PQUV_STATUS_OK;
+        if (result_status == PGRES_PIPELINE_ABORTED)
+        {
+            status = PQUV_STATUS_ABORTED;
+        }
+        else if (!result_ok(result_status) && PQstatus(pg->conn) == CONNECTION_BAD)
+        {
+            status = PQUV_STATUS_DISCONNECTED;
+        }
+
+        if (!result_ok(result_status) && status == PQUV_STATUS_OK)
+        {
+            LOG_DEBUG("Query error: %s", PQresultErrorMessage(result));
+        }
+
+        pg_query_t *query = pg->current_query;
+        int kept = 0;
+        if (query && !query->first_at && !(query->flags & QUERY_INTERNAL))
+        {
+            query->first_at = uv_hrtime();
+            hist_record(&pg->stats.first_byte, query->sent_at, query->first_at);
+            trace_query(pg, query, PQUV_TRACE_FIRST_RESULT, query->first_at);
+        }
+
+        // The COPY's own result comes once its data has been moved
+        if (result_status == PGRES_COPY_IN || result_status == PGRES_COPY_OUT)
+        {
+            PQclear(result);
+            pg->copy_state = result_status == PGRES_COPY_IN ? COPY_IN : COPY_OUT;
+            continue;
+        }
+
+        if (query && (query->flags & QUERY_INTERNAL))
+        {
+            // A failed PREPARE is reported to the query that needed it
+            if (!result_ok(result_status) && (query->flags & QUERY_PREPARE))
+            {
+                if (query->stmt->id == query->stmt_id)
+                {
+                    forget_statement(query->stmt);
+                }
+
+                pg_query_t *owner = query->owner;
+                owner->flags |= QUERY_FAILED;
+                if (owner->result_cb)
+                {
+                    kept = deliver(pg, owner->result_cb, result, owner->data, status);
+                }
+            }
+            else if (query->flags & QUERY_HEALTH)
+            {
+                health_result(pg, result);
+            }
+        }
+        else if (query && !(query->flags & QUERY_FAILED))
+        {
+            // Streamed rows go to row_cb, the final result to result_cb.
+            // Columnar queries decode their rows instead and pass on only
+            // the final result.
+            pg_result_cb_t cb = query->result_cb;
+            if (query->columns && result_ok(result_status) && result_status != PGRES_COMMAND_OK)
+            {
+                if (fill_columns(pg, query, result) != 0)
+                {
+                    query->flags |= QUERY_FAILED;
+                    if (query->result_cb)
+                    {
+                        PGresult *error = PQmakeEmptyPGresult(pg->conn, PGRES_FATAL_ERROR);
+                        if (!deliver(pg, query->result_cb, error, query->data, PQUV_STATUS_ERROR))
+                        {
+                            PQclear(error);
+                        }
+                    }
+                    cb = NULL;
+                }
+                else if (result_status != PGRES_TUPLES_OK)
+                {
+                    cb = NULL;
+                }
+            }
+            else if (query->row_cb && result_status != PGRES_TUPLES_OK && result_ok(result_status))
+            {
+                cb = query->row_cb;
+            }
+
+            // The cache takes its copy first, the callback may keep the
+            // result and free it before it returns
+            if ((query->flags & QUERY_CACHE_FILL) && pg->cache && result_status == PGRES_TUPLES_OK &&
+                status == PQUV_STATUS_OK)
+            {
+                cache_store(pg, query, result);
+            }
+
+            if (cb)
+            {
+                kept = deliver(pg, cb, result, query->data, status);
+            }
+            if (cb == query->result_cb)
+            {
+                query->flags |= QUERY_DELIVERED;
+            }
+
+            // This was the query's final result
+            if (!result_ok(result_status))
+            {
+                query->flags |= QUERY_FAILED;
+            }
+        }
+
+        if (!kept)
+        {
+            PQclear(result);
+        }
+
+        // Replication COPY is not supported, and a broken connection fails
+        // everything still in flight
+        int copy_both = result_status == PGRES_COPY_BOTH;
+        if (copy_both || PQstatus(pg->conn) == CONNECTION_BAD)
+        {
+            handle_error(pg, copy_both ? "COPY BOTH is not supported" : PQerrorMessage(pg->conn));
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+// Switch the head of the in-flight list to row streaming. This must run
+// before libpq parses any of its results.
+static void begin_results(pg_async_t *pg)
+{
+    pg_query_t *query = pg->current_query;
+    pg->row_mode_pending = 0;
+
+    // It expired while waiting behind other queries in the pipeline
+    if (query && query->deadline && query->deadline <= uv_now(pg->loop))
+    {
+        start_cancel(pg);
+    }
+
+    if (!query || query->chunk_size <= 0)
+        return;
+
+    int ok;
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    if (query->chunk_size > 1)
+    {
+        ok = PQsetChunkedRowsMode(pg->conn, query->chunk_size);
+    }
+    else
+    {
+        ok = PQsetSingleRowMode(pg->conn);
+    }
+#else
+    ok = PQsetSingleRowMode(pg->conn);
+#endif
+
+    // In pipeline mode this fails while a sync point is ahead of the query,
+    // retry once its PGRES_PIPELINE_SYNC result has been consumed
+    if (!ok)
+    {
+        pg->row_mode_pending = 1;
+    }
+}
+
+// Whether a result status is a success
+static int result_ok(ExecStatusType status)
+{
+    switch (status)
+    {
+    case PGRES_TUPLES_OK:
+    case PGRES_COMMAND_OK:
+    case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    case PGRES_TUPLES_CHUNK:
+#endif
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Poll callback
+static void on_poll(uv_poll_t *handle, int status, int events)
+{
+    if (!handle || !handle->data)
+    {
+        LOG_ERROR("Invalid handle or handle->data");
+        return;
+    }
+
+    pg_async_t *pg = (pg_async_t *)handle->data;
+
+    // An idle persistent context only hears from the server when it closes
+    // the connection
+    if (!pg->is_executing)
+    {
+        if (status < 0 || ((events & UV_READABLE) && !PQconsumeInput(pg->conn)) ||
+            PQstatus(pg->conn) != CONNECTION_OK)
+        {
+            LOG_WARN("Idle connection lost: %s", PQerrorMessage(pg->conn));
+            connection_lost(pg);
+            return;
+        }
+        dispatch_notifies(pg);
+        return;
+    }
+
+    if (status < 0)
+    {
+        LOG_WARN("Poll error: %s", uv_strerror(status));
+        handle_error(pg, uv_strerror(status));
+        return;
+    }
+
+    if ((events & UV_READABLE) && !PQconsumeInput(pg->conn))
+    {
+        LOG_WARN("PQconsumeInput failed: %s", PQerrorMessage(pg->conn));
+        handle_error(pg, PQerrorMessage(pg->conn));
+        return;
+    }
+
+    // Keep flushing until libpq's output buffer is empty, then stop watching writability
+    if (pg->flushing)
+    {
+        if (flush_output(pg) != 0)
+        {
+            handle_error(pg, PQerrorMessage(pg->conn));
+            return;
+        }
+
+        if (!pg->flushing && set_poll_events(pg, UV_READABLE) != 0)
+        {
+            handle_error(pg, "Failed to update poll events");
+            return;
+        }
+    }
+
+    int result = process_results(pg);
+    if (result < 0)
+    {
+        return;
+    }
+
+    // Notifications are parsed along with the results
+    dispatch_notifies(pg);
+    if (result == 0 || pg->destroying)
+    {
+        return;
+    }
+
+    // The poll stays armed, execute_next_query only adjusts its events
+    execute_next_query(pg);
+}
+
+// Cleanup a query structure
+static void cleanup_query(pg_async_t *pg, pg_query_t *query)
+{
+    if (!query)
+        return;
+
+    if (!(query->flags & QUERY_INTERNAL) && query->queued_at)
+    {
+        uint64_t now = uv_hrtime();
+        pg->stats.completed++;
+        if (query->sent_at)
+        {
+            hist_record(&pg->stats.execution, query->sent_at, now);
+        }
+        hist_record(&pg->stats.total, query->queued_at, now);
+        trace_query(pg, query, PQUV_TRACE_DONE, now);
+    }
+
+    if ((query->flags & QUERY_TX) && pg->tx)
+    {
+        tx_step(pg, query);
+    }
+    if (query->flags & QUERY_HEALTH)
+    {
+        pg->health_sent = 0;
+    }
+
+    // Hand caller-owned nodes back, the release callback may free them. It
+    // counts as a result callback, so a shutdown from there is deferred the
+    // same way.
+    if (query->flags & PQUV_QUERY_CALLER_OWNED)
+    {
+        if (query->release_cb)
+        {
+            pg->delivering++;
+            query->release_cb(query);
+            pg->delivering--;
+        }
+        return;
+    }
+
+    // Arena and borrowed strings are not freed one by one
+    mem_free(query->storage);
+    release_query(pg, query);
+}
+
+// Results are delivered through here so callbacks can ask for their status
+static int deliver(pg_async_t *pg, pg_result_cb_t cb, PGresult *result, void *data, pquv_status_t status)
+{
+    if (status != PQUV_STATUS_OK)
+    {
+        pg->stats.failed++;
+    }
+    else if (PQresultStatus(result) == PGRES_FATAL_ERROR)
+    {
+        pg->stats.errors++;
+    }
+
+    PGresult *outer = pg->delivered_result;
+    pg->query_status = status;
+    pg->delivered_result = result;
+    pg->delivering++;
+    cb(pg, result, data);
+    pg->delivering--;
+    int kept = pg->delivered_result == NULL;
+    pg->delivered_result = outer;
+    pg->query_status = PQUV_STATUS_OK;
+    return kept;
+}
+
+PGresult *pquv_keep_result(pg_async_t *pg)
+{
+    if (!pg || !pg->delivered_result)
+    {
+        LOG_ERROR("No result is being delivered");
+        return NULL;
+    }
+
+    PGresult *result = pg->delivered_result;
+    pg->delivered_result = NULL;
+    return result;
+}
+
+pquv_status_t pquv_query_status(const pg_async_t *pg)
+{
+    return pg ? pg->query_status : PQUV_STATUS_ERROR;
+}
+
+// Report a query the server produced no result for, then free it
+static void fail_query(pg_async_t *pg, pg_query_t *query, pquv_status_t status)
+{
+    if (query->flags & QUERY_PREPARE)
+    {
+        // The statement was never prepared, the owner runs unprepared or
+        // fails on its own
+        if (query->stmt->id == query->stmt_id)
+        {
+            forget_statement(query->stmt);
+        }
+        query->owner->stmt = NULL;
+    }
+    else if (!(query->flags & (QUERY_INTERNAL | QUERY_FAILED | QUERY_DELIVERED)) && query->result_cb)
+    {
+        // Synthetic error results carry the connection's error message
+        PGresult *result = PQmakeEmptyPGresult(pg->conn, PGRES_FATAL_ERROR);
+        if (!deliver(pg, query->result_cb, result, query->data, status))
+        {
+            PQclear(result);
+        }
+    }
+
+    // A transaction does not survive its session
+    if ((query->flags & QUERY_TX) &&
+        (status == PQUV_STATUS_DISCONNECTED || status == PQUV_STATUS_CANCELLED || status == PQUV_STATUS_SHUTDOWN))
+    {
+        tx_lost(pg, status);
+    }
+
+    query->flags |= QUERY_FAILED;
+    cleanup_query(pg, query);
+}
+
+// Fail everything sent but not completed. The lists are detached first so
+// callbacks can queue new work.
+static void fail_in_flight(pg_async_t *pg, pquv_status_t status)
+{
+    pg_query_t *query = pg->current_query;
+    pg->current_query = pg->sent_queue_tail = NULL;
+    pg->in_flight = 0;
+    pg->pending_syncs = 0;
+    pg->row_mode_pending = 0;
+
+    while (query)
+    {
+        pg_query_t *next = query->next;
+        fail_query(pg, query, status);
+        query = next;
+    }
+}
+
+static void fail_queued(pg_async_t *pg, pquv_status_t status)
+{
+    pg_query_t *query = pg->query_queue;
+    pg->query_queue = pg->query_queue_tail = NULL;
+    pg->queued = 0;
+    pg->queued_bytes = 0;
+    check_watermarks(pg);
+
+    while (query)
+    {
+        pg_query_t *next = query->next;
+        fail_query(pg, query, status);
+        query = next;
+    }
+}
+
+// Reconnect an owned connection in the background, keeping the queue
+static int start_reset(pg_async_t *pg)
+{
+    LOG_INFO("Reconnecting");
+    pg->stats.reconnects++;
+    reset_statements(pg);
+    pg->in_pipeline = 0;
+    pg->flushing = 0;
+
+    if (!PQresetStart(pg->conn))
+    {
+        LOG_WARN("PQresetStart failed: %s", PQerrorMessage(pg->conn));
+        return -1;
+    }
+
+    pg->is_connecting = 1;
+    pg->reconnecting = 1;
+
+    // The socket is new even if it got the same descriptor, rebuild the poll
+    pg->poll_fd = -1;
+    if (watch_connect(pg, PGRES_POLLING_WRITING) != 0)
+    {
+        pg->is_connecting = 0;
+        pg->reconnecting = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Delay before the next reset: a random share of min_ms for the first one,
+// then doubling per failed reset up to max_ms, less up to half at random
+static uint64_t backoff_delay(pg_async_t *pg, unsigned int min_ms, unsigned int max_ms)
+{
+    // splitmix64 of the time and the context, callers on several threads
+    // share no state
+    uint64_t r = uv_hrtime() ^ (uint64_t)(uintptr_t)pg;
+    r += 0x9e3779b97f4a7c15ULL;
+    r = (r ^ (r >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    r = (r ^ (r >> 27)) * 0x94d049bb133111ebULL;
+    r ^= r >> 31;
+
+    if (pg->reconnect_attempts == 0)
+        return r % ((uint64_t)min_ms + 1);
+
+    uint64_t base = min_ms;
+    for (int i = 1; i < pg->reconnect_attempts && base < max_ms; i++)
+    {
+        base *= 2;
+    }
+    if (base > max_ms)
+    {
+        base = max_ms;
+    }
+    return base - r % (base / 2 + 1);
+}
+
+// Start the next reset once its backoff has passed, see pquv_set_reconnect
+static int schedule_reconnect(pg_async_t *pg)
+{
+    // A pooled connection that never got through retries even without a
+    // policy, or a server that was down when the pool was created would
+    // keep it out of the pool for good
+    int first = pg->pool && !pg->reconnect_min_ms && !pg->ever_connected;
+    unsigned int min_ms = first ? POOL_RETRY_MIN_MS : pg->reconnect_min_ms;
+    unsigned int max_ms = first ? POOL_RETRY_MAX_MS : pg->reconnect_max_ms;
+    int max_attempts = first ? POOL_RETRY_ATTEMPTS : pg->reconnect_max_attempts;
+    if (!min_ms || !pg->owns_connection || pg->destroying || (max_attempts && pg->reconnect_attempts >= max_attempts))
+        return -1;
+
+    uint64_t delay = backoff_delay(pg, min_ms, max_ms);
+    pg->reconnect_attempts++;
+    LOG_INFO("Reconnecting in %llu ms, attempt %d", (unsigned long long)delay, pg->reconnect_attempts);
+
+    pg->reconnect_at = uv_now(pg->loop) + delay;
+    arm_timer(pg, pg->reconnect_at);
+    if (!pg->timer_initialized)
+    {
+        pg->reconnect_at = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// An owned connection that broke while idle is reset like one that broke
+// under a query, so the next query and the subscriptions get it back
+static void connection_lost(pg_async_t *pg)
+{
+    pg->is_connected = 0;
+    close_poll(pg);
+
+    if (!pg->owns_connection || pg->destroying)
+        return;
+
+    if ((pg->reconnect_min_ms ? schedule_reconnect(pg) : start_reset(pg)) == 0)
+        return;
+
+    // Nothing queued meanwhile can run
+    fail_queued(pg, PQUV_STATUS_DISCONNECTED);
+}
+
+// Move idempotent queries that got no result yet from the in-flight list back
+// to the front of the queue, in their original order, to run on the next
+// connection. The rest stay in flight to be failed.
+static void replay_in_flight(pg_async_t *pg)
+{
+    pg_query_t *replay = NULL;
+    pg_query_t *replay_tail = NULL;
+    pg_query_t **link = &pg->current_query;
+    while (*link)
+    {
+        pg_query_t *query = *link;
+        if (!(query->flags & PQUV_QUERY_IDEMPOTENT) ||
+            (query->flags & (QUERY_INTERNAL | QUERY_FAILED | QUERY_DELIVERED | QUERY_TX)) || query->first_at ||
+            query->copy_write_cb || query->copy_data_cb)
+        {
+            link = &query->next;
+            continue;
+        }
+
+        *link = query->next;
+        query->next = NULL;
+        if (replay_tail)
+        {
+            replay_tail->next = query;
+        }
+        else
+        {
+            replay = query;
+        }
+        replay_tail = query;
+        pg->in_flight--;
+        pg->queued++;
+        pg->queued_bytes += query->bytes;
+        pg->stats.replayed++;
+    }
+
+    if (!replay)
+        return;
+
+    replay_tail->next = pg->query_queue;
+    pg->query_queue = replay;
+    if (!pg->query_queue_tail)
+    {
+        pg->query_queue_tail = replay_tail;
+    }
+}
+
+// A new session has none of the cached statements. Queued PREPAREs and
+// DEALLOCATEs are dropped and their owners go through the cache again.
+static void reset_statements(pg_async_t *pg)
+{
+    pg_query_t *query = pg->query_queue;
+    pg->query_queue = pg->query_queue_tail = NULL;
+    pg->queued = 0;
+    pg->queued_bytes = 0;
+
+    while (query)
+    {
+        pg_query_t *next = query->next;
+        if (query->flags & QUERY_INTERNAL)
+        {
+            cleanup_query(pg, query);
+        }
+        else
+        {
+            query->flags &= ~QUERY_CACHE_CHECKED;
+            query->stmt = NULL;
+            query->next = NULL;
+            if (!pg->query_queue)
+            {
+                pg->query_queue = query;
+            }
+            else
+            {
+                pg->query_queue_tail->next = query;
+            }
+            pg->query_queue_tail = query;
+            pg->queued++;
+            pg->queued_bytes += query->bytes;
+        }
+        query = next;
+    }
+
+    for (int i = 0; i < pg->stmt_capacity; i++)
+    {
+        forget_statement(&pg->stmt_cache[i]);
+    }
+}
+
+// Connection-level failure. Queries in flight may or may not have run and are
+// reported as disconnected. An owned connection is reset and keeps its queue,
+// otherwise the queue is failed as well.
+static void handle_error(pg_async_t *pg, const char *error)
+{
+    LOG_WARN("%s", error ? error : "Unknown error");
+
+    if (pg->error_message)
+    {
+        mem_free(pg->error_message);
+    }
+    pg->error_message = error ? mem_strdup(error) : NULL;
+
+    // Nothing may start on this connection from the callbacks below
+    if (PQstatus(pg->conn) == CONNECTION_BAD)
+    {
+        close_poll(pg);
+    }
+    set_poll_events(pg, 0);
+    reset_copy(pg);
+    pg->is_executing = 0;
+    pg->is_connected = 0;
+
+    // Only an owned connection comes back for them
+    int resets = pg->owns_connection && !pg->destroying;
+    if (resets)
+    {
+        replay_in_flight(pg);
+    }
+    fail_in_flight(pg, PQUV_STATUS_DISCONNECTED);
+
+    if (resets && (pg->reconnect_min_ms ? schedule_reconnect(pg) : start_reset(pg)) == 0)
+    {
+        return;
+    }
+
+    fail_queued(pg, PQUV_STATUS_DISCONNECTED);
+
+    // A borrowed connection that is still usable stays in service if nothing
+    // is left running on it
+    if (PQstatus(pg->conn) == CONNECTION_OK && !pg->is_connecting)
+    {
+        drain_results(pg);
+        if (PQtransactionStatus(pg->conn) != PQTRANS_ACTIVE)
+        {
+            pg->is_connected = 1;
+        }
+        else
+        {
+            LOG_WARN("Connection is still busy, marking it unusable");
+        }
+    }
+
+    finish_execution(pg);
+
+    // Pick up anything the callbacks queued on a persistent context
+    if (pg->persistent && pg->is_connected && pg->query_queue && !pg->is_executing)
+    {
+        pquv_execute(pg);
+    }
+}
+
+// Run the timer for the earliest deadline
+static void arm_timer(pg_async_t *pg, uint64_t deadline)
+{
+    if (pg->timer_deadline && pg->timer_deadline <= deadline)
+        return;
+
+    if (!pg->timer_initialized)
+    {
+        int init_result = uv_timer_init(pg->loop, &pg->timer);
+        if (init_result != 0)
+        {
+            LOG_ERROR("uv_timer_init failed: %s", uv_strerror(init_result));
+            return;
+        }
+        pg->timer.data = pg;
+        pg->timer_initialized = 1;
+        pg->open_handles++;
+    }
+
+    uint64_t now = uv_now(pg->loop);
+    uv_timer_start(&pg->timer, on_timer, deadline > now ? deadline - now : 0, 0);
+    pg->timer_deadline = deadline;
+}
+
+// Report expired queries, cancel the one running if it expired, and wait
+// for the next deadline
+static void on_timer(uv_timer_t *handle)
+{
+    pg_async_t *pg = (pg_async_t *)handle->data;
+    uint64_t now = uv_now(pg->loop);
+    uint64_t next = pg->shutdown_deadline;
+    pg->timer_deadline = 0;
+
+    if (pg->shutdown_deadline && pg->shutdown_deadline <= now)
+    {
+        pg_async_destroy(pg);
+        return;
+    }
+
+    // A reset waiting out its backoff. One that cannot start counts as failed.
+    if (pg->reconnect_at && pg->reconnect_at <= now)
+    {
+        pg->reconnect_at = 0;
+        if (start_reset(pg) != 0)
+        {
+            connect_failed(pg, 1);
+            if (pg->destroying)
+                return;
+        }
+    }
+    if (pg->reconnect_at && (!next || pg->reconnect_at < next))
+    {
+        next = pg->reconnect_at;
+    }
+
+    // In-flight queries first, then the queue. Callbacks may append to the
+    // queue, new queries have later deadlines.
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (pg_query_t *query = pass == 0 ? pg->current_query : pg->query_queue; query; query = query->next)
+        {
+            if (!query->deadline || (query->flags & (QUERY_INTERNAL | QUERY_FAILED | QUERY_DELIVERED)))
+                continue;
+
+            if (query->deadline > now)
+            {
+                if (!next || query->deadline < next)
+                    next = query->deadline;
+                continue;
+            }
+
+            // Whatever the server still sends for it is discarded
+            query->flags |= QUERY_FAILED;
+            if (query->result_cb)
+            {
+                PGresult *result = PQmakeEmptyPGresult(pg->conn, PGRES_FATAL_ERROR);
+                if (!deliver(pg, query->result_cb, result, query->data, PQUV_STATUS_TIMEOUT))
+                {
+                    PQclear(result);
+                }
+            }
+        }
+    }
+
+    pg_query_t *head = pg->current_query;
+    if (head && head->deadline && head->deadline <= now)
+    {
+        start_cancel(pg);
+
+        // A COPY FROM STDIN may be waiting on the caller, end it from on_poll
+        if (pg->copy_state == COPY_IN)
+        {
+            set_poll_events(pg, UV_READABLE | UV_WRITABLE);
+        }
+    }
+
+    if (next)
+    {
+        arm_timer(pg, next);
+    }
+}
+
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+static void on_cancel_closed(uv_handle_t *handle)
+{
+    struct pquv_cancel *request = (struct pquv_cancel *)handle->data;
+    PQcancelFinish(request->conn);
+    mem_free(request);
+}
+
+// Drive the cancel connection like a regular one
+static void on_cancel_poll(uv_poll_t *handle, int status, int events)
+{
+    (void)status;
+    (void)events;
+
+    struct pquv_cancel *request = (struct pquv_cancel *)handle->data;
+    PostgresPollingStatusType poll_status = PQcancelPoll(request->conn);
+    if (poll_status == PGRES_POLLING_FAILED)
+    {
+        LOG_WARN("Cancel failed: %s", PQcancelErrorMessage(request->conn));
+    }
+
+    // A uv_poll_t cannot follow the cancel connection to another socket
+    if (poll_status == PGRES_POLLING_READING || poll_status == PGRES_POLLING_WRITING)
+    {
+        if (PQcancelSocket(request->conn) == request->sock)
+        {
+            uv_poll_start(handle, poll_status == PGRES_POLLING_READING ? UV_READABLE : UV_WRITABLE, on_cancel_poll);
+            return;
+        }
+        LOG_WARN("Cancel connection changed sockets, giving up");
+    }
+
+    cancel_done(request);
+    uv_close((uv_handle_t *)handle, on_cancel_closed);
+}
+#else
+// PQcancel blocks until the server has the request, so it runs on the threadpool
+static void cancel_work(uv_work_t *req)
+{
+    struct pquv_cancel *request = (struct pquv_cancel *)req->data;
+    char errbuf[256];
+    if (!PQcancel(request->cancel, errbuf, sizeof(errbuf)))
+    {
+        LOG_WARN("PQcancel failed: %s", errbuf);
+    }
+}
+
+static void cancel_work_done(uv_work_t *req, int status)
+{
+    (void)status;
+
+    struct pquv_cancel *request = (struct pquv_cancel *)req->data;
+    cancel_done(request);
+    PQfreeCancel(request->cancel);
+    mem_free(request);
+}
+#endif
+
+// Ask the server to cancel what the connection is running, without blocking
+// the loop. The cancelled query's error result is discarded, in pipeline mode
+// the queries after it up to the sync point are aborted.
+static void start_cancel(pg_async_t *pg)
+{
+    if (pg->cancel)
+        return;
+
+    struct pquv_cancel *request = mem_calloc(1, sizeof(struct pquv_cancel));
+    if (!request)
+    {
+        LOG_ERROR("Failed to allocate cancel request");
+        return;
+    }
+    request->pg = pg;
+
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    request->conn = PQcancelCreate(pg->conn);
+    if (!request->conn || !PQcancelStart(request->conn))
+    {
+        LOG_WARN("PQcancelStart failed: %s",
+                 request->conn ? PQcancelErrorMessage(request->conn) : "out of memory");
+        PQcancelFinish(request->conn);
+        mem_free(request);
+        return;
+    }
+
+    request->sock = PQcancelSocket(request->conn);
+#ifdef _WIN32
+    int init_result = uv_poll_init_socket(pg->loop, &request->poll, (uv_os_sock_t)request->sock);
+#else
+    int init_result = uv_poll_init(pg->loop, &request->poll, request->sock);
+#endif
+    if (init_result != 0)
+    {
+        LOG_ERROR("uv_poll_init failed: %s", uv_strerror(init_result));
+        PQcancelFinish(request->conn);
+        mem_free(request);
+        return;
+    }
+
+    request->poll.data = request;
+    uv_poll_start(&request->poll, UV_WRITABLE, on_cancel_poll);
+#else
+    request->cancel = PQgetCancel(pg->conn);
+    request->work.data = request;
+    if (!request->cancel || uv_queue_work(pg->loop, &request->work, cancel_work, cancel_work_done) != 0)
+    {
+        LOG_ERROR("Failed to queue cancel request");
+        PQfreeCancel(request->cancel);
+        mem_free(request);
+        return;
+    }
+#endif
+
+    pg->cancel = request;
+}
+
+// The cancel request is done, a new one may be started. The server has it
+// by now, so the queries held back for it can go.
+static void cancel_done(struct pquv_cancel *request)
+{
+    pg_async_t *pg = request->pg;
+    if (!pg)
+        return;
+
+    pg->cancel = NULL;
+    request->pg = NULL;
+    if (pg->is_executing && !pg->current_query && !pg->destroying)
+    {
+        execute_next_query(pg);
+    }
+}
+
+// Discard results that are already buffered for cancelled queries
+static void drain_results(pg_async_t *pg)
+{
+    int empty = 0;
+    while (empty < 2 && PQtransactionStatus(pg->conn) == PQTRANS_ACTIVE && !PQisBusy(pg->conn))
+    {
+        PGresult *result = PQgetResult(pg->conn);
+        if (!result)
+        {
+            empty++;
+            continue;
+        }
+        empty = 0;
+        PQclear(result);
+    }
+}
+
+// Binary format helpers. Values are big-endian on the wire.
+static int binary_value(const PGresult *result, int row, int col, int len, const unsigned char **out)
+{
+    if (PQgetisnull(result, row, col) || PQfformat(result, col) != 1)
+        return -1;
+
+    if (len >= 0 && PQgetlength(result, row, col) != len)
+        return -1;
+
+    *out = (const unsigned char *)PQgetvalue(result, row, col);
+    return 0;
+}
+
+static uint64_t read_be64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static void write_be64(char *buf, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--)
+    {
+        buf[i] = (char)(v & 0xff);
+        v >>= 8;
+    }
+}
+
+int pquv_get_int4(const PGresult *result, int row, int col, int32_t *out)
+{
+    const unsigned char *p;
+    if (!out || binary_value(result, row, col, 4, &p) != 0)
+        return -1;
+
+    *out = (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]);
+    return 0;
+}
+
+int pquv_get_int8(const PGresult *result, int row, int col, int64_t *out)
+{
+    const unsigned char *p;
+    if (!out || binary_value(result, row, col, 8, &p) != 0)
+        return -1;
+
+    *out = (int64_t)read_be64(p);
+    return 0;
+}
+
+int pquv_get_float8(const PGresult *result, int row, int col, double *out)
+{
+    const unsigned char *p;
+    if (!out || binary_value(result, row, col, 8, &p) != 0)
+        return -1;
+
+    uint64_t bits = read_be64(p);
+    memcpy(out, &bits, sizeof(*out));
+    return 0;
+}
+
+int pquv_get_timestamptz(const PGresult *result, int row, int col, int64_t *out)
+{
+    int64_t pg_usec;
+    if (!out || pquv_get_int8(result, row, col, &pg_usec) != 0)
+        return -1;
+
+    *out = pg_usec + PQUV_PG_EPOCH_USEC;
+    return 0;
+}
+
+int pquv_get_uuid(const PGresult *result, int row, int col, unsigned char out[16])
+{
+    const unsigned char *p;
+    if (!out || binary_value(result, row, col, 16, &p) != 0)
+        return -1;
+
+    memcpy(out, p, 16);
+    return 0;
+}
+
+const char *pquv_get_bytea(const PGresult *result, int row, int col, int *len)
+{
+    const unsigned char *p;
+    if (binary_value(result, row, col, -1, &p) != 0)
+        return NULL;
+
+    if (len)
+    {
+        *len = PQgetlength(result, row, col);
+    }
+    return (const char *)p;
+}
+
+// Bytes per value of a batch column, 0 for text and bytea, -1 when the type
+// cannot be decoded into columns
+static int column_width(Oid type)
+{
+    switch (type)
+    {
+    case PQUV_BOOLOID:
+        return 1;
+    case PQUV_INT4OID:
+        return 4;
+    case PQUV_INT8OID:
+    case PQUV_FLOAT8OID:
+    case PQUV_TIMESTAMPTZOID:
+        return 8;
+    case PQUV_UUIDOID:
+        return 16;
+    case PQUV_TEXTOID:
+    case PQUV_BYTEAOID:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+// The result's column types are checked once per chunk, not per cell
+static int columns_match(const pquv_columns_t *batch, const PGresult *result)
+{
+    if (PQnfields(result) != batch->column_count)
+    {
+        LOG_WARN("Result has %d columns, the batch %d", PQnfields(result), batch->column_count);
+        return -1;
+    }
+
+    for (int i = 0; i < batch->column_count; i++)
+    {
+        if (PQftype(result, i) != batch->columns[i].type || PQfformat(result, i) != 1)
+        {
+            LOG_WARN("Column %d is type %u, the batch expects binary %u", i, PQftype(result, i),
+                     batch->columns[i].type);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Whether a row's text and bytea values fit behind those already in the batch
+static int row_fits(const pquv_columns_t *batch, const PGresult *result, int row)
+{
+    for (int i = 0; i < batch->column_count; i++)
+    {
+        const pquv_column_t *column = &batch->columns[i];
+        if (column_width(column->type) != 0 || PQgetisnull(result, row, i))
+            continue;
+
+        if ((size_t)PQgetlength(result, row, i) > column->data_size - column->offsets[batch->rows])
+            return 0;
+    }
+    return 1;
+}
+
+static int decode_row(pquv_columns_t *batch, const PGresult *result, int row)
+{
+    int n = batch->rows;
+    for (int i = 0; i < batch->column_count; i++)
+    {
+        pquv_column_t *column = &batch->columns[i];
+        int width = column_width(column->type);
+        int is_null = PQgetisnull(result, row, i);
+        if (is_null && !column->nulls)
+        {
+            LOG_WARN("Column %d is NULL but has no null flags", i);
+            return -1;
+        }
+        if (column->nulls)
+        {
+            column->nulls[n] = (unsigned char)is_null;
+        }
+
+        const unsigned char *p = (const unsigned char *)PQgetvalue(result, row, i);
+        int len = PQgetlength(result, row, i);
+        if (width == 0)
+        {
+            size_t used = column->offsets[n];
+            if (!is_null)
+            {
+                memcpy(column->data + used, p, (size_t)len);
+                used += (size_t)len;
+            }
+            column->offsets[n + 1] = used;
+            continue;
+        }
+
+        unsigned char *out = (unsigned char *)column->values + (size_t)n * (size_t)width;
+        if (is_null)
+        {
+            memset(out, 0, (size_t)width);
+            continue;
+        }
+        if (len != width)
+        {
+            LOG_WARN("Column %d has a %d byte value, expected %d", i, len, width);
+            return -1;
+        }
+
+        switch (column->type)
+        {
+        case PQUV_BOOLOID:
+            *out = p[0] != 0;
+            break;
+        case PQUV_INT4OID:
+        {
+            int32_t v = (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]);
+            memcpy(out, &v, sizeof(v));
+            break;
+        }
+        case PQUV_TIMESTAMPTZOID:
+        {
+            int64_t v = (int64_t)read_be64(p) + PQUV_PG_EPOCH_USEC;
+            memcpy(out, &v, sizeof(v));
+            break;
+        }
+        case PQUV_INT8OID:
+        case PQUV_FLOAT8OID:
+        {
+            // float8 shares int8's byte order
+            uint64_t v = read_be64(p);
+            memcpy(out, &v, sizeof(v));
+            break;
+        }
+        default:
+            memcpy(out, p, (size_t)width);
+            break;
+        }
+    }
+    return 0;
+}
+
+// Hand a batch to the caller and start the next one
+static void flush_columns(pg_async_t *pg, pg_query_t *query)
+{
+    pquv_columns_t *batch = query->columns;
+    pg->delivering++;
+    query->batch_cb(pg, batch, query->data);
+    pg->delivering--;
+
+    batch->rows = 0;
+    for (int i = 0; i < batch->column_count; i++)
+    {
+        if (batch->columns[i].offsets)
+        {
+            batch->columns[i].offsets[0] = 0;
+        }
+    }
+}
+
+// Decode a row, chunk or whole result into the query's batch, flushing full
+// batches and what is left once the final result arrives
+static int fill_columns(pg_async_t *pg, pg_query_t *query, const PGresult *result)
+{
+    pquv_columns_t *batch = query->columns;
+    int rows = PQntuples(result);
+    if (rows > 0 && columns_match(batch, result) != 0)
+        return -1;
+
+    for (int row = 0; row < rows; row++)
+    {
+        if (batch->rows > 0 && !row_fits(batch, result, row))
+        {
+            flush_columns(pg, query);
+        }
+        if (!row_fits(batch, result, row))
+        {
+            LOG_WARN("Row %d does not fit the batch's data buffers", row);
+            return -1;
+        }
+        if (decode_row(batch, result, row) != 0)
+            return -1;
+
+        if (++batch->rows == batch->capacity)
+        {
+            flush_columns(pg, query);
+        }
+    }
+
+    if (PQresultStatus(result) == PGRES_TUPLES_OK && batch->rows > 0)
+    {
+        flush_columns(pg, query);
+    }
+    return 0;
+}
+
+void pquv_put_int4(char buf[4], int32_t value)
+{
+    uint32_t v = (uint32_t)value;
+    buf[0] = (char)(v >> 24);
+    buf[1] = (char)(v >> 16);
+    buf[2] = (char)(v >> 8);
+    buf[3] = (char)v;
+}
+
+void pquv_put_int8(char buf[8], int64_t value)
+{
+    write_be64(buf, (uint64_t)value);
+}
+
+void pquv_put_float8(char buf[8], double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    write_be64(buf, bits);
+}
+
+void pquv_put_timestamptz(char buf[8], int64_t unix_usec)
+{
+    write_be64(buf, (uint64_t)(unix_usec - PQUV_PG_EPOCH_USEC));
+}
+
+void pquv_copy_buf_init(pquv_copy_buf_t *buf)
+{
+    memset(buf, 0, sizeof(*buf));
+}
+
+void pquv_copy_buf_reset(pquv_copy_buf_t *buf)
+{
+    buf->len = 0;
+    buf->failed = 0;
+}
+
+void pquv_copy_buf_free(pquv_copy_buf_t *buf)
+{
+    mem_free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+static int copy_buf_reserve(pquv_copy_buf_t *buf, size_t extra)
+{
+    if (buf->failed)
+        return -1;
+
+    if (buf->cap - buf->len >= extra)
+        return 0;
+
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap - buf->len < extra)
+    {
+        cap *= 2;
+    }
+
+    char *data = mem_alloc(cap);
+    if (!data)
+    {
+        buf->failed = 1;
+        return -1;
+    }
+    if (buf->len)
+    {
+        memcpy(data, buf->data, buf->len);
+    }
+    mem_free(buf->data);
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+// Signature, flags and header extension length of the binary COPY format
+int pquv_copy_binary_header(pquv_copy_buf_t *buf)
+{
+    static const char header[19] = "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0";
+    if (copy_buf_reserve(buf, sizeof(header)) != 0)
+        return -1;
+
+    memcpy(buf->data + buf->len, header, sizeof(header));
+    buf->len += sizeof(header);
+    return 0;
+}
+
+int pquv_copy_binary_row(pquv_copy_buf_t *buf, int field_count)
+{
+    if (field_count < 0 || field_count > 32767 || copy_buf_reserve(buf, 2) != 0)
+        return -1;
+
+    buf->data[buf->len++] = (char)(field_count >> 8);
+    buf->data[buf->len++] = (char)field_count;
+    return 0;
+}
+
+int pquv_copy_binary_field(pquv_copy_buf_t *buf, const void *value, int len)
+{
+    if (!value)
+    {
+        len = -1;
+    }
+    if (len < -1 || copy_buf_reserve(buf, 4 + (len > 0 ? (size_t)len : 0)) != 0)
+        return -1;
+
+    pquv_put_int4(buf->data + buf->len, len);
+    buf->len += 4;
+    if (len > 0)
+    {
+        memcpy(buf->data + buf->len, value, (size_t)len);
+        buf->len += (size_t)len;
+    }
+    return 0;
+}
+
+int pquv_copy_binary_int4(pquv_copy_buf_t *buf, int32_t value)
+{
+    char bytes[4];
+    pquv_put_int4(bytes, value);
+    return pquv_copy_binary_field(buf, bytes, 4);
+}
+
+int pquv_copy_binary_int8(pquv_copy_buf_t *buf, int64_t value)
+{
+    char bytes[8];
+    pquv_put_int8(bytes, value);
+    return pquv_copy_binary_field(buf, bytes, 8);
+}
+
+int pquv_copy_binary_float8(pquv_copy_buf_t *buf, double value)
+{
+    char bytes[8];
+    pquv_put_float8(bytes, value);
+    return pquv_copy_binary_field(buf, bytes, 8);
+}
+
+int pquv_copy_binary_text(pquv_copy_buf_t *buf, const char *value)
+{
+    size_t len = value ? strlen(value) : 0;
+    if (len > 0x7fffffff)
+        return -1;
+
+    return pquv_copy_binary_field(buf, value, (int)len);
+}
+
+// The file trailer is a field count of -1
+int pquv_copy_binary_trailer(pquv_copy_buf_t *buf)
+{
+    if (copy_buf_reserve(buf, 2) != 0)
+        return -1;
+
+    buf->data[buf->len++] = (char)0xff;
+    buf->data[buf->len++] = (char)0xff;
+    return 0;
+}
@@ -1,25 +1,266 @@
 #ifndef PQUV_H
 #define PQUV_H
 
+#include <stdint.h>
 #include <libpq-fe.h>
 #include "uv.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Type OIDs for typed and binary parameters
+#define PQUV_BOOLOID 16
+#define PQUV_BYTEAOID 17
+#define PQUV_INT8OID 20
+#define PQUV_INT4OID 23
+#define PQUV_TEXTOID 25
+#define PQUV_FLOAT8OID 701
+#define PQUV_TIMESTAMPTZOID 1184
+#define PQUV_UUIDOID 2950
+
+// Microseconds between the Unix epoch and the PostgreSQL epoch (2000-01-01)
+#define PQUV_PG_EPOCH_USEC 946684800000000LL
+
 // Forward declarations
 typedef struct pg_async pg_async_t;
 typedef struct pg_query pg_query_t;
+typedef struct pquv_pool pquv_pool_t;
+typedef struct pg_stmt pg_stmt_t;
+typedef struct pquv_mailbox pquv_mailbox_t;
+typedef struct pquv_tx pquv_tx_t;
+typedef struct pquv_cache pquv_cache_t;
 
 // Result callback function type
 typedef void (*pg_result_cb_t)(pg_async_t *pg, PGresult *result, void *data);
 
+// How the result passed to a callback came about, see pquv_query_status.
+// Every status except OK comes with a result pquv made itself, with the
+// connection's error message, or PGRES_PIPELINE_ABORTED for ABORTED.
+typedef enum
+{
+    PQUV_STATUS_OK = 0,       // The server's result, check PQresultStatus for errors
+    PQUV_STATUS_ERROR,        // The query could not be sent
+    PQUV_STATUS_ABORTED,      // Skipped after an earlier error in the same pipeline
+    PQUV_STATUS_DISCONNECTED, // The connection was lost before the query completed
+    PQUV_STATUS_CANCELLED,    // Discarded because the context or pool was destroyed
+    PQUV_STATUS_TIMEOUT,      // The query's deadline passed, see pquv_set_timeout
+    PQUV_STATUS_SHUTDOWN,     // Discarded by a shutdown, see pquv_shutdown
+    PQUV_STATUS_REJECTED      // Shed to make room, see pquv_set_queue_limit
+} pquv_status_t;
+
+// Called once pquv no longer references a caller-owned query
+typedef void (*pg_query_release_cb_t)(pg_query_t *query);
+
+// Query flags
+#define PQUV_QUERY_BORROWED 0x100     // SQL and parameters belong to the caller
+#define PQUV_QUERY_CALLER_OWNED 0x200 // The pg_query_t itself belongs to the caller
+#define PQUV_QUERY_READ_ONLY 0x400    // A pool may send it to a replica
+#define PQUV_QUERY_IDEMPOTENT 0x800   // Safe to resend after a lost connection
+
+// Role of the server a pooled connection goes to
+typedef enum
+{
+    PQUV_ROLE_PRIMARY,
+    PQUV_ROLE_REPLICA
+} pquv_role_t;
+
+// How a pool picks among the connections that can take a query
+typedef enum
+{
+    PQUV_BALANCE_LEAST_LOAD,   // Least outstanding work, round-robin between equals
+    PQUV_BALANCE_ROUND_ROBIN,  // Each connection in turn
+    PQUV_BALANCE_LEAST_LATENCY // Outstanding work weighted by health check round trips
+} pquv_balance_t;
+
+// One server of a pool and how many connections to open to it
+typedef struct
+{
+    const char *conninfo;
+    pquv_role_t role;
+    int size;
+} pquv_pool_node_t;
+
+// Connect callback function type, status is 0 on success and -1 on failure
+typedef void (*pg_connect_cb_t)(pg_async_t *pg, int status, void *data);
+
+// Asks a COPY FROM STDIN query for more data, see pquv_queue_copy_in
+typedef void (*pquv_copy_write_cb_t)(pg_async_t *pg, void *data);
+
+// Receives one row, or for binary COPY one chunk, of COPY TO STDOUT output
+typedef void (*pquv_copy_data_cb_t)(pg_async_t *pg, const char *buf, int len, void *data);
+
+// Result of a query submitted with pquv_pool_submit. result is NULL when the
+// query could not be queued, and is cleared after the callback returns.
+typedef void (*pquv_submit_cb_t)(PGresult *result, pquv_status_t status, void *data);
+
+// End of a transaction: PQUV_STATUS_OK once committed, PQUV_STATUS_ABORTED
+// once rolled back, otherwise the status its connection was lost with
+typedef void (*pquv_tx_cb_t)(pquv_status_t status, void *data);
+
+// Caller-owned column of a pquv_queue_columns batch. Fixed-width values are
+// stored contiguously in values: unsigned char for bool, int32_t for int4,
+// int64_t for int8, double for float8, int64_t Unix microseconds for
+// timestamptz and 16 bytes for uuid. text and bytea are packed into data,
+// row i spanning offsets[i] to offsets[i + 1], so offsets needs capacity + 1
+// entries. nulls, when set, holds capacity flags; without it a NULL fails
+// the query.
+typedef struct
+{
+    Oid type;
+    void *values;
+    char *data;
+    size_t data_size;
+    size_t *offsets;
+    unsigned char *nulls;
+} pquv_column_t;
+
+typedef struct
+{
+    pquv_column_t *columns;
+    int column_count;
+    int capacity; // Rows each column holds
+    int rows;     // Rows filled, set by pquv
+} pquv_columns_t;
+
+// Receives a filled batch. The columns are reused for the next rows once
+// the callback returns.
+typedef void (*pquv_batch_cb_t)(pg_async_t *pg, pquv_columns_t *batch, void *data);
+
+// What a full queue does with a new query, see pquv_set_queue_limit
+typedef enum
+{
+    PQUV_OVERFLOW_REJECT = 0, // Refuse it
+    PQUV_OVERFLOW_CALLBACK,   // Let queue_full_cb decide
+    PQUV_OVERFLOW_SHED        // Fail queued queries, earliest deadline first, to make room
+} pquv_overflow_t;
+
+// Asked whether a query may exceed the queue limit. Return non-zero to
+// queue it anyway, 0 to refuse it. The query is not queued yet.
+typedef int (*pquv_queue_full_cb_t)(pg_async_t *pg, const pg_query_t *query, void *data);
+
+// The queue reached its high watermark (above = 1) or drained back to its
+// low one (above = 0)
+typedef void (*pquv_watermark_cb_t)(int above, void *data);
+
+// Receives a NOTIFY on a channel subscribed to with pquv_listen
+typedef void (*pquv_notify_cb_t)(pg_async_t *pg, const char *channel, const char *payload, int be_pid, void *data);
+
+// Diagnostic levels, see pquv_set_log
+typedef enum
+{
+    PQUV_LOG_DEBUG = 0, // Expected per-query events, such as server errors
+    PQUV_LOG_INFO = 1,  // Connection lifecycle, such as reconnects
+    PQUV_LOG_WARN = 2,  // Failures pquv recovers from or reports to callbacks
+    PQUV_LOG_ERROR = 3  // API misuse and resource failures
+} pquv_log_level_t;
+
+// Log callback, func is the pquv function the message comes from
+typedef void (*pquv_log_cb_t)(pquv_log_level_t level, const char *func, const char *message, void *data);
+
+// Messages below this level are compiled out of pquv.c, 4 removes them all
+#ifndef PQUV_LOG_LEVEL
+#define PQUV_LOG_LEVEL 0
+#endif
+
+// Latency histogram with power-of-two buckets, bucket i counts durations
+// of [2^i, 2^(i+1)) microseconds, bucket 0 anything under 2us
+#define PQUV_HIST_BUCKETS 32
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum_usec;
+    uint64_t max_usec;
+    uint64_t buckets[PQUV_HIST_BUCKETS];
+} pquv_histogram_t;
+
+// Counters and latencies of a context, or of a whole pool, since it was
+// created or last reset. Internal PREPARE and DEALLOCATE queries are not
+// counted.
+typedef struct
+{
+    uint64_t queued;     // Queries accepted
+    uint64_t sent;       // Sends, a query resent after a reconnect counts twice
+    uint64_t completed;  // Queries done, with or without an error
+    uint64_t errors;     // Error results from the server
+    uint64_t failed;     // Callbacks with a status other than PQUV_STATUS_OK
+    uint64_t reconnects; // Connection resets started
+    uint64_t replayed;   // In-flight queries resent after a lost connection
+    uint64_t cache_hits; // Queries answered from the result cache
+    uint64_t rejected;   // Queries refused or shed by a queue limit
+    int queue_depth;     // Waiting to be sent, at the time of the snapshot
+    int in_flight;       // Sent and waiting for results
+
+    pquv_histogram_t queue_wait; // Queued until sent
+    pquv_histogram_t first_byte; // Sent until the first result was read
+    pquv_histogram_t execution;  // Sent until done
+    pquv_histogram_t total;      // Queued until done
+} pquv_stats_t;
+
+// Points in a query's life reported to a trace hook
+typedef enum
+{
+    PQUV_TRACE_QUEUED = 0,
+    PQUV_TRACE_SENT,
+    PQUV_TRACE_FIRST_RESULT,
+    PQUV_TRACE_DONE
+} pquv_trace_event_t;
+
+// Trace hook, time is uv_hrtime() in nanoseconds. The query must not be
+// modified and is only valid during the call.
+typedef void (*pquv_trace_cb_t)(pg_async_t *pg,
+                                const pg_query_t *query,
+                                pquv_trace_event_t event,
+                                uint64_t time,
+                                void *data);
+
 // Query structure
 struct pg_query
 {
     char *sql;
     char **params;
     int param_count;
+    Oid *param_types;   // NULL lets the server infer them
+    int *param_lengths; // Only needed for binary parameters
+    int *param_formats; // NULL = all text, otherwise 0 = text, 1 = binary
+    int result_format;  // 0 = text, 1 = binary
     pg_result_cb_t result_cb;
+    pg_result_cb_t row_cb; // Streamed rows, see pquv_queue_rows
+    int chunk_size;        // 0 = whole result, 1 = single-row mode, >1 = chunked
+    pquv_columns_t *columns;  // Decode target, see pquv_queue_columns
+    pquv_batch_cb_t batch_cb;
+    pquv_copy_write_cb_t copy_write_cb; // COPY FROM STDIN, see pquv_queue_copy_in
+    pquv_copy_data_cb_t copy_data_cb;   // COPY TO STDOUT, see pquv_queue_copy_out
+    unsigned int timeout_ms; // 0 = the context's timeout
     void *data;
     pg_query_t *next;
+
+    pg_query_release_cb_t release_cb; // Caller-owned queries only
+
+    // Managed by pquv
+    int flags;
+    pg_stmt_t *stmt;     // Cached statement this query executes
+    unsigned long stmt_id;
+    pg_query_t *owner;   // Query an internal PREPARE belongs to
+    void *storage;       // Heap block holding copied SQL and parameters
+    uint64_t deadline;   // uv_now() time the query times out at, 0 = none
+    uint64_t queued_at;  // uv_hrtime() timestamps for the stats
+    uint64_t sent_at;
+    uint64_t first_at;
+    size_t bytes;        // SQL and parameter bytes charged to the queue limit
+};
+
+// Prepared statement cache entry
+struct pg_stmt
+{
+    uint64_t hash;
+    char *sql; // NULL when the slot is free
+    Oid *param_types;
+    int param_count;
+    unsigned long id;
+    unsigned long last_used;
+    char name[32];
 };
 
 // Main async PostgreSQL context
@@ -30,23 +271,173 @@ struct pg_async
     int is_connected;
     int is_executing;
     int handle_initialized;
+    int was_nonblocking;
+    int flushing; // PQflush has output pending
 
-#ifdef _WIN32
-    uv_timer_t timer;
-#else
+    // COPY in progress for the query at the head of the in-flight list
+    int copy_state;
+    int copy_ending;        // pquv_copy_end was called, PQputCopyEnd is pending
+    int copy_produced;      // Data was put during the current write callback
+    size_t copy_unflushed;  // Bytes put since the last flush
+    char copy_error[128];   // Reason the COPY is aborted with, empty = commit
+
+    uv_loop_t *loop;
     uv_poll_t poll;
-#endif
+    int poll_fd;
+    int poll_events; // Events the poll is armed for, -1 while connecting
+    int poll_closing; // Closed with its socket, rebuilt once the close completes
+    int open_handles;
+    int destroying;
+
+    // Non-blocking connection establishment
+    int is_connecting;
+    PostgresPollingStatusType connect_wait;
+    pg_connect_cb_t connect_cb;
+    int reconnecting; // PQresetStart after the connection was lost
+
+    // Reset backoff, see pquv_set_reconnect (0 min = reset once, right away)
+    unsigned int reconnect_min_ms;
+    unsigned int reconnect_max_ms;
+    int reconnect_max_attempts;
+    int reconnect_attempts; // Resets started since the last successful one
+    int ever_connected;     // Has been connected at least once
+    uint64_t reconnect_at;  // Loop time the next reset starts, 0 = none
 
     pg_query_t *query_queue;
     pg_query_t *query_queue_tail;
-    pg_query_t *current_query;
+    pg_query_t *current_query; // Head of the in-flight list
+    pg_query_t *sent_queue_tail;
+    int queued;
+    int in_flight;
+
+    // Pipeline mode (0 = disabled, otherwise max queries in flight)
+    int pipeline_window;
+    int in_pipeline;
+    int pending_syncs;
+    int row_mode_pending;
 
+    // Prepared statement cache (LRU, 0 capacity = disabled)
+    pg_stmt_t *stmt_cache;
+    int stmt_capacity;
+    unsigned long stmt_clock;
+
+    // Query node slabs with their free list, and the arena copied SQL and
+    // parameters are allocated from
+    struct pquv_slab *query_slabs;
+    pg_query_t *free_queries;
+    struct pquv_arena_block *arena;
+    int arena_blocks;
+
+    int persistent;    // Stay alive and idle when the queue drains
+    int hold_start;    // Queued queries wait until the batch is complete
+
+    // Coalescing window, an idle context collects queries before it starts
+    uv_check_t coalesce;
+    uv_idle_t coalesce_spin; // Keeps the loop from blocking for the last sub-ms
+    int coalesce_initialized;
+    int coalesce_max; // 0 = disabled
+    unsigned int coalesce_usec;
+    uint64_t coalesce_start; // hrtime the window opened, 0 = not collecting
+    struct pquv_listener *listeners;
+    int notifying;     // Listeners are being called, removal is deferred
+    pquv_cache_t *cache; // For pquv_queue_cached, NULL = none
+    pquv_pool_t *pool; // Owning pool, NULL for standalone contexts
+    pquv_tx_t *tx;     // Transaction the connection is pinned to
+
+    // Pool routing, kept up to date by the health check
+    pquv_role_t role;
+    int unhealthy;         // pg_is_in_recovery() disagrees with role, or failed
+    int in_recovery;       // Result of the last health check
+    uint64_t health_sent;  // hrtime a health check was queued, 0 = none pending
+    uint64_t latency_usec; // Moving average of health check round trips
+
+    // Graceful shutdown, queued work drains before the context is destroyed
+    int shutting_down;
+    uint64_t shutdown_deadline; // Loop time the drain is cut short, 0 = none
+
+    // Deadlines, one timer for the earliest one
+    uv_timer_t timer;
+    int timer_initialized;
+    uint64_t timer_deadline;
+    unsigned int timeout_ms;
+    struct pquv_cancel *cancel; // Cancel request in progress
+
+    // Admission control, see pquv_set_queue_limit (0 = unlimited)
+    int max_queued;
+    size_t max_queued_bytes;
+    size_t queued_bytes;
+    pquv_overflow_t overflow;
+    pquv_queue_full_cb_t queue_full_cb;
+    void *queue_full_data;
+    int high_watermark; // 0 = no watermark callback
+    int low_watermark;
+    int above_watermark;
+    pquv_watermark_cb_t watermark_cb;
+    void *watermark_data;
+
+    pquv_stats_t stats;
+    pquv_trace_cb_t trace_cb;
+    void *trace_data;
+
+    pquv_status_t query_status; // Of the result being delivered
+    PGresult *delivered_result; // NULL once taken with pquv_keep_result
+    int delivering;             // Nesting depth of result callbacks
     char *error_message;
     void *data; // User data
 };
 
+// Pool of connections, each driven by its own pg_async_t
+struct pquv_pool
+{
+    uv_loop_t *loop;
+    pg_async_t **conns;
+    int size;
+    int next; // Round-robin start for ties
+    pquv_balance_t balance;
+    struct pquv_health *health; // Periodic pg_is_in_recovery() checks
+    int destroying;
+    int shutting_down;
+    int live; // Connections still shutting down, the pool is freed at 0
+    struct pquv_remote *remote; // Submissions from other threads
+
+    // Limits and watermarks over the queues of all connections together
+    int max_queued;
+    size_t max_queued_bytes;
+    pquv_overflow_t overflow;
+    pquv_queue_full_cb_t queue_full_cb;
+    void *queue_full_data;
+    int high_watermark;
+    int low_watermark;
+    int above_watermark;
+    pquv_watermark_cb_t watermark_cb;
+    void *watermark_data;
+
+    void *data; // User data
+};
+
 // Public API functions
+
+// Replace the allocator pquv uses for its own memory; NULL restores malloc or
+// free. Must be called before any context or pool is created.
+void pquv_set_allocator(void *(*malloc_fn)(size_t), void (*free_fn)(void *));
+
+// Send diagnostics at min_level and above to log_cb, which runs on the
+// thread that hit them and should not block. Nothing is logged until a
+// callback is installed; NULL removes it.
+void pquv_set_log(pquv_log_cb_t log_cb, pquv_log_level_t min_level, void *data);
+
+// Contexts and pools are bound to one loop and must only be used from the
+// thread running it. The variants without a loop use uv_default_loop().
 pg_async_t *pquv_create(PGconn *existing_conn, void *data);
+pg_async_t *pquv_create_ex(uv_loop_t *loop, PGconn *existing_conn, void *data);
+
+// Connect without blocking the loop. The returned context owns its connection
+// and can queue queries right away; call pquv_execute once connect_cb reports
+// success. On failure the context is destroyed after connect_cb returns.
+pg_async_t *pquv_connect(uv_loop_t *loop,
+                         const char *conninfo,
+                         pg_connect_cb_t connect_cb,
+                         void *data);
 int pquv_queue(pg_async_t *pg,
                const char *sql,
                int param_count,
@@ -55,4 +446,398 @@ int pquv_queue(pg_async_t *pg,
                void *query_data);
 int pquv_execute(pg_async_t *pg);
 
+// Queue a query that is safe to run twice, such as a read. If the connection
+// is lost while it is in flight and pquv resets it, the query is sent again
+// on the new connection instead of failing as PQUV_STATUS_DISCONNECTED. A
+// query whose first result has been read is never resent.
+int pquv_queue_idempotent(pg_async_t *pg,
+                          const char *sql,
+                          int param_count,
+                          const char **params,
+                          pg_result_cb_t result_cb,
+                          void *query_data);
+
+// Queue a query without copying anything. sql and params must stay valid until
+// the query has completed, i.e. its last result callback has returned.
+int pquv_queue_borrowed(pg_async_t *pg,
+                        const char *sql,
+                        int param_count,
+                        const char *const *params,
+                        pg_result_cb_t result_cb,
+                        void *query_data);
+
+// Queue a pg_query_t filled in by the caller; nothing is allocated or copied.
+// Set sql, params and param_count, optionally the typed/binary and row
+// streaming fields, result_cb and data; the fields under "Managed by pquv" are
+// reset. The node and everything it points to must stay valid until
+// release_cb is called, which happens after the last result was delivered or
+// when the query is discarded. The node may be freed or reused from there.
+// release_cb may do what a result callback may: queue more work, or call
+// pquv_shutdown or pquv_pool_shutdown, but not destroy the context or pool.
+int pquv_queue_query(pg_async_t *pg, pg_query_t *query);
+
+// Queue a query with explicit parameter types (may be NULL), per-parameter
+// formats (NULL = all text, 1 = binary, which requires param_lengths) and a
+// result format (0 = text, 1 = binary). Values are copied.
+int pquv_queue_typed(pg_async_t *pg,
+                     const char *sql,
+                     int param_count,
+                     const Oid *param_types,
+                     const char *const *param_values,
+                     const int *param_lengths,
+                     const int *param_formats,
+                     int result_format,
+                     pg_result_cb_t result_cb,
+                     void *query_data);
+
+// Queue a query whose rows are delivered to row_cb as they arrive instead of
+// being buffered into one PGresult. chunk_size 1 uses single-row mode; larger
+// values use chunked mode on libpq 17+ and fall back to single rows otherwise.
+// result_cb receives the final PGRES_TUPLES_OK (with no rows) or the error.
+int pquv_queue_rows(pg_async_t *pg,
+                    const char *sql,
+                    int param_count,
+                    const char **params,
+                    int chunk_size,
+                    pg_result_cb_t row_cb,
+                    pg_result_cb_t result_cb,
+                    void *query_data);
+
+// Queue a query whose binary rows are decoded straight into the caller's
+// column arrays as they stream in. Each full batch, or one whose text and
+// bytea buffers cannot take the next row, goes to batch_cb; the rest is
+// flushed before result_cb receives the final PGRES_TUPLES_OK or the error.
+// A result whose columns do not match the batch's types, or a value that
+// does not fit, fails the query with PQUV_STATUS_ERROR. The batch must stay
+// valid until result_cb has run.
+int pquv_queue_columns(pg_async_t *pg,
+                       const char *sql,
+                       int param_count,
+                       const char **params,
+                       pquv_columns_t *batch,
+                       pquv_batch_cb_t batch_cb,
+                       pg_result_cb_t result_cb,
+                       void *query_data);
+
+// Keep the context alive when its queue drains instead of destroying it.
+// Queries queued on an idle persistent context start right away, also from
+// inside result callbacks, so pquv_execute is not needed after the first
+// call; a persistent context created by pquv_connect starts its queue once
+// connected. Free it with pquv_destroy.
+int pquv_set_persistent(pg_async_t *pg, int persistent);
+
+// Discard queued and in-flight queries and free the context. Must not be
+// called from inside one of its own callbacks, nor on pooled connections.
+void pquv_destroy(pg_async_t *pg);
+
+// Take ownership of the result being delivered, only valid inside a result
+// callback. pquv does not clear it afterwards; the caller must PQclear it.
+PGresult *pquv_keep_result(pg_async_t *pg);
+
+// Status of the result being delivered, only meaningful inside a result
+// callback. A failing query gets its error and the rest of the queue keeps
+// running; in pipeline mode the queries after it up to the next sync point
+// are ABORTED. When the connection is lost, queries in flight are failed as
+// DISCONNECTED; a connection pquv owns is then reset in the background and
+// the queue resumes once it is back, otherwise the queue is failed too.
+pquv_status_t pquv_query_status(const pg_async_t *pg);
+
+// Give queries queued from now on timeout_ms to complete, counted from when
+// they are queued; 0 disables the timeout. A non-zero pg_query_t::timeout_ms
+// overrides it. An expired query's callback gets PQUV_STATUS_TIMEOUT right
+// away and its server results are discarded. If the query is running, the
+// server is asked to cancel it without blocking the loop, using
+// PQcancelStart on libpq 17+ and PQcancel on the libuv threadpool otherwise.
+int pquv_set_timeout(pg_async_t *pg, unsigned int timeout_ms);
+
+// Retry failed resets of a connection pquv owns with exponential backoff.
+// The first reset after a loss starts within a random 0..min_ms, and each
+// failed one doubles the delay up to max_ms, with up to half of it taken off
+// at random so a fleet of clients does not reconnect in lockstep. Queued
+// queries wait for the connection; they fail as PQUV_STATUS_DISCONNECTED
+// after max_attempts resets in a row have failed (0 = keep trying), unless
+// their timeout passes first. Pooled connections whose first connect failed
+// retry the same way. min_ms 0 restores the default of a single immediate
+// reset.
+int pquv_set_reconnect(pg_async_t *pg, unsigned int min_ms, unsigned int max_ms, int max_attempts);
+
+// Bound the queue to max_queries waiting to be sent and max_bytes of their
+// SQL and parameters (0 = unlimited). A query that would exceed a limit is
+// refused, and the queueing function returns -1, unless overflow says
+// otherwise: PQUV_OVERFLOW_CALLBACK asks queue_full_cb, and
+// PQUV_OVERFLOW_SHED fails queued queries with PQUV_STATUS_REJECTED until
+// the new one fits, earliest deadline first and the oldest among those with
+// none. Queries already on their way to the server are never shed. Internal
+// and transaction statements are not limited but count towards the totals.
+int pquv_set_queue_limit(pg_async_t *pg,
+                         int max_queries,
+                         size_t max_bytes,
+                         pquv_overflow_t overflow,
+                         pquv_queue_full_cb_t queue_full_cb,
+                         void *data);
+
+// Call watermark_cb once the queue holds high queries and again once it is
+// down to low, so a server can stop taking requests before the limit is
+// hit. high 0 disables it. The callback must not destroy the context.
+int pquv_set_watermarks(pg_async_t *pg, int high, int low, pquv_watermark_cb_t watermark_cb, void *data);
+
+// Stop accepting queries and destroy the context once the queries already
+// queued have completed. A graceful shutdown lets them run for up to
+// timeout_ms (0 waits indefinitely); when the budget runs out, or right away
+// when graceful is 0, the running query is cancelled without blocking and the
+// remaining callbacks get PQUV_STATUS_SHUTDOWN. The context may be freed
+// before this returns, so it must not be used afterwards.
+int pquv_shutdown(pg_async_t *pg, int graceful, unsigned int timeout_ms);
+
+// Subscribe notify_cb to NOTIFYs on channel. The first subscriber of a
+// channel queues its LISTEN, and subscriptions are renewed when the
+// connection is reset. Needs a persistent context, whose poll stays armed
+// for readability so notifications are delivered as soon as they arrive.
+int pquv_listen(pg_async_t *pg, const char *channel, pquv_notify_cb_t notify_cb, void *data);
+
+// Remove a subscription, UNLISTEN is queued once a channel has none left
+int pquv_unlisten(pg_async_t *pg, const char *channel, pquv_notify_cb_t notify_cb, void *data);
+
+// Result cache shared by the contexts of one loop, holding up to max_bytes of
+// results for ttl_ms each (0 = until evicted). Destroy it after every context
+// that uses it or listens for it.
+pquv_cache_t *pquv_cache_create(size_t max_bytes, unsigned int ttl_ms);
+void pquv_cache_destroy(pquv_cache_t *cache);
+void pquv_cache_clear(pquv_cache_t *cache);
+
+// Drop cached results on every NOTIFY on channel: those whose SQL contains
+// the payload, or all of them for an empty payload. pg must be persistent.
+int pquv_cache_listen(pquv_cache_t *cache, pg_async_t *pg, const char *channel);
+
+// Use cache for queries queued with pquv_queue_cached, NULL stops it
+int pquv_set_cache(pg_async_t *pg, pquv_cache_t *cache);
+
+// Like pquv_queue for a read whose result may be reused. If the cache holds
+// an unexpired result for the same SQL and parameters, result_cb gets a copy
+// of it before this returns, ahead of anything still queued. Otherwise the
+// query is queued and a successful result is cached.
+int pquv_queue_cached(pg_async_t *pg,
+                      const char *sql,
+                      int param_count,
+                      const char **params,
+                      pg_result_cb_t result_cb,
+                      void *query_data);
+
+// Copy the context's counters and histograms into out. Timestamps come from
+// uv_hrtime() when a query is queued, sent, first has a result and is done.
+int pquv_stats(const pg_async_t *pg, pquv_stats_t *out);
+void pquv_stats_reset(pg_async_t *pg);
+
+// Upper bound in microseconds of the bucket holding the given percentile
+// (0-100) of a histogram, 0 when it is empty
+uint64_t pquv_histogram_percentile(const pquv_histogram_t *hist, double percentile);
+
+// Call trace_cb at each point of every query's life, NULL disables it
+int pquv_set_trace(pg_async_t *pg, pquv_trace_cb_t trace_cb, void *data);
+
+// Enable pipeline mode with up to max_in_flight queries sent ahead of their
+// results, or disable it with 0. Queries run through the extended protocol in
+// pipeline mode, so each SQL string must hold a single statement.
+int pquv_set_pipeline(pg_async_t *pg, int max_in_flight);
+
+// Let a persistent context that is idle collect queries for up to window_usec
+// microseconds, checked at the end of each loop iteration, or until
+// max_queries are queued, then start them together. In pipeline mode they go
+// out in one write with a single sync point. 0 max_queries disables it.
+// Whole milliseconds of the window are waited out in poll; for the last
+// fraction the loop keeps turning without blocking, so short windows add no
+// timer granularity.
+int pquv_set_coalesce(pg_async_t *pg, int max_queries, unsigned int window_usec);
+
+// Cache up to capacity prepared statements, 0 disables the cache. Queries with
+// parameters are prepared the first time their SQL is seen and executed with
+// PQsendQueryPrepared afterwards; the least recently used statement is
+// deallocated when the cache is full.
+int pquv_set_statement_cache(pg_async_t *pg, int capacity);
+
+// Pool API. Connections are opened in the background with pquv_connect and
+// queries queued before any is ready wait for the first one. Pooled contexts
+// own their connections and are persistent; result callbacks receive the
+// pooled pg_async_t whose data field points to the pool. pquv_pool_destroy must not be called from inside
+// a result callback.
+pquv_pool_t *pquv_pool_create(const char *conninfo, int size, void *data);
+pquv_pool_t *pquv_pool_create_ex(uv_loop_t *loop, const char *conninfo, int size, void *data);
+
+// Pool over a primary and its replicas. Queries go to the primaries unless
+// they are read-only: pquv_pool_queue_read, or PQUV_QUERY_READ_ONLY set in
+// the flags of a query given to pquv_pool_queue_query. Those go to a replica,
+// or to a primary when no replica is usable.
+pquv_pool_t *pquv_pool_create_nodes(uv_loop_t *loop, const pquv_pool_node_t *nodes, int node_count, void *data);
+int pquv_pool_queue_read(pquv_pool_t *pool,
+                         const char *sql,
+                         int param_count,
+                         const char **params,
+                         pg_result_cb_t result_cb,
+                         void *query_data);
+int pquv_pool_set_balance(pquv_pool_t *pool, pquv_balance_t balance);
+
+// Run pg_is_in_recovery() on every connection each interval_ms, and once
+// after each connect. A connection whose answer does not match its role, or
+// whose check fails, gets no queries until a later check agrees. 0 stops it.
+int pquv_pool_set_health_check(pquv_pool_t *pool, unsigned int interval_ms);
+
+// Share cache between the pool's connections. Cached queries are read-only
+// and may go to a replica.
+int pquv_pool_set_cache(pquv_pool_t *pool, pquv_cache_t *cache);
+int pquv_pool_queue_cached(pquv_pool_t *pool,
+                           const char *sql,
+                           int param_count,
+                           const char **params,
+                           pg_result_cb_t result_cb,
+                           void *query_data);
+int pquv_pool_queue(pquv_pool_t *pool,
+                    const char *sql,
+                    int param_count,
+                    const char **params,
+                    pg_result_cb_t result_cb,
+                    void *query_data);
+int pquv_pool_queue_query(pquv_pool_t *pool, pg_query_t *query);
+int pquv_pool_set_pipeline(pquv_pool_t *pool, int max_in_flight);
+int pquv_pool_set_coalesce(pquv_pool_t *pool, int max_queries, unsigned int window_usec);
+int pquv_pool_set_statement_cache(pquv_pool_t *pool, int capacity);
+int pquv_pool_set_timeout(pquv_pool_t *pool, unsigned int timeout_ms);
+int pquv_pool_set_reconnect(pquv_pool_t *pool, unsigned int min_ms, unsigned int max_ms, int max_attempts);
+
+// Limits and watermarks over all the pool's queues together, checked in
+// addition to those of each connection. Shedding picks from any of them.
+int pquv_pool_set_queue_limit(pquv_pool_t *pool,
+                              int max_queries,
+                              size_t max_bytes,
+                              pquv_overflow_t overflow,
+                              pquv_queue_full_cb_t queue_full_cb,
+                              void *data);
+int pquv_pool_set_watermarks(pquv_pool_t *pool, int high, int low, pquv_watermark_cb_t watermark_cb, void *data);
+int pquv_pool_queue_idempotent(pquv_pool_t *pool,
+                               const char *sql,
+                               int param_count,
+                               const char **params,
+                               pg_result_cb_t result_cb,
+                               void *query_data);
+int pquv_pool_set_trace(pquv_pool_t *pool, pquv_trace_cb_t trace_cb, void *data);
+
+// Sum of the stats of every pooled connection still open
+int pquv_pool_stats(const pquv_pool_t *pool, pquv_stats_t *out);
+void pquv_pool_destroy(pquv_pool_t *pool);
+
+// Queue a query on the pool from any thread. SQL and parameters are copied,
+// and submissions made between two turns of the pool's loop are queued
+// together so they share pipeline flushes. submit_cb runs on the loop of
+// mailbox, which must be the calling thread's; with a NULL mailbox it runs
+// on the pool's loop. Once the pool is shut down or destroyed, submitting
+// returns -1, and submissions still waiting get PQUV_STATUS_SHUTDOWN or
+// PQUV_STATUS_CANCELLED. The pool must still exist: submitters must stop
+// before a shutdown completes or pquv_pool_destroy returns.
+int pquv_pool_submit(pquv_pool_t *pool,
+                     pquv_mailbox_t *mailbox,
+                     const char *sql,
+                     int param_count,
+                     const char **params,
+                     pquv_submit_cb_t submit_cb,
+                     void *data);
+
+// Transactions. pquv_tx_begin pins an idle pooled connection, or the least
+// loaded one, and the pool routes nothing else to it until the transaction
+// ends. BEGIN and the statements queued with pquv_tx_queue are held until
+// pquv_tx_commit, behind anything the connection already had queued, so in
+// pipeline mode the whole transaction goes out as one
+// batch. After the first failed statement the rest are skipped with
+// PQUV_STATUS_ABORTED and the transaction is rolled back. pquv_tx_rollback
+// drops statements that were not sent yet. done_cb may run before commit or
+// rollback returns, and the transaction is freed after it.
+pquv_tx_t *pquv_tx_begin(pquv_pool_t *pool, const char *begin_sql);
+int pquv_tx_queue(pquv_tx_t *tx,
+                  const char *sql,
+                  int param_count,
+                  const char **params,
+                  pg_result_cb_t result_cb,
+                  void *query_data);
+int pquv_tx_commit(pquv_tx_t *tx, pquv_tx_cb_t done_cb, void *data);
+int pquv_tx_rollback(pquv_tx_t *tx, pquv_tx_cb_t done_cb, void *data);
+
+// Receives results of pquv_pool_submit on the loop it was created for. It
+// holds that loop open only while results are outstanding. Destroy it from
+// its own loop; results that arrive later are discarded.
+pquv_mailbox_t *pquv_mailbox_create(uv_loop_t *loop);
+void pquv_mailbox_destroy(pquv_mailbox_t *mailbox);
+
+// Shut down every pooled connection like pquv_shutdown, the pool is freed
+// with the last one. Unlike pquv_pool_destroy this may be called from inside
+// a result callback.
+int pquv_pool_shutdown(pquv_pool_t *pool, int graceful, unsigned int timeout_ms);
+
+// Run a COPY ... FROM STDIN. Once the server is ready, write_cb is called
+// whenever there is room for more data and passes it to pquv_copy_put; when
+// it returns without putting anything, pquv waits for the caller to resume
+// with pquv_copy_put from elsewhere. pquv_copy_end finishes the COPY and
+// result_cb gets its outcome. COPY needs pipeline mode to be off.
+int pquv_queue_copy_in(pg_async_t *pg,
+                       const char *sql,
+                       pquv_copy_write_cb_t write_cb,
+                       pg_result_cb_t result_cb,
+                       void *query_data);
+
+// Run a COPY ... TO STDOUT, data_cb gets each row as it arrives and
+// result_cb the final result
+int pquv_queue_copy_out(pg_async_t *pg,
+                        const char *sql,
+                        pquv_copy_data_cb_t data_cb,
+                        pg_result_cb_t result_cb,
+                        void *query_data);
+
+// Send COPY data. Returns 0 when more can be put right away, 1 when the data
+// was taken but output is backed up, so the caller should stop until
+// write_cb is called again, and -1 on failure.
+int pquv_copy_put(pg_async_t *pg, const char *buf, int len);
+
+// Finish the COPY in progress, or abort it with error as the reason
+int pquv_copy_end(pg_async_t *pg, const char *error);
+
+// Growable buffer for building binary COPY data (WITH (FORMAT binary)).
+// Every call returns 0 or -1; a failed allocation also sets failed so a
+// whole batch can be checked once. Pass data and len to pquv_copy_put.
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+} pquv_copy_buf_t;
+
+void pquv_copy_buf_init(pquv_copy_buf_t *buf);
+void pquv_copy_buf_reset(pquv_copy_buf_t *buf);
+void pquv_copy_buf_free(pquv_copy_buf_t *buf);
+int pquv_copy_binary_header(pquv_copy_buf_t *buf);
+int pquv_copy_binary_row(pquv_copy_buf_t *buf, int field_count);
+int pquv_copy_binary_field(pquv_copy_buf_t *buf, const void *value, int len); // len -1 = NULL
+int pquv_copy_binary_int4(pquv_copy_buf_t *buf, int32_t value);
+int pquv_copy_binary_int8(pquv_copy_buf_t *buf, int64_t value);
+int pquv_copy_binary_float8(pquv_copy_buf_t *buf, double value);
+int pquv_copy_binary_text(pquv_copy_buf_t *buf, const char *value); // NULL = NULL
+int pquv_copy_binary_trailer(pquv_copy_buf_t *buf);
+
+// Binary result decoding. The getters return 0 on success and -1 when the
+// value is NULL, not in binary format or has an unexpected length.
+// Timestamps are microseconds since the Unix epoch.
+int pquv_get_int4(const PGresult *result, int row, int col, int32_t *out);
+int pquv_get_int8(const PGresult *result, int row, int col, int64_t *out);
+int pquv_get_float8(const PGresult *result, int row, int col, double *out);
+int pquv_get_timestamptz(const PGresult *result, int row, int col, int64_t *out);
+int pquv_get_uuid(const PGresult *result, int row, int col, unsigned char out[16]);
+const char *pquv_get_bytea(const PGresult *result, int row, int col, int *len);
+
+// Binary parameter encoding into caller-provided buffers
+void pquv_put_int4(char buf[4], int32_t value);
+void pquv_put_int8(char buf[8], int64_t value);
+void pquv_put_float8(char buf[8], double value);
+void pquv_put_timestamptz(char buf[8], int64_t unix_usec);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,444 @@
+#ifndef PQUV_HPP
+#define PQUV_HPP
+
+// Header-only C++20 layer over pquv: co_await a query from any coroutine.
+//
+//     pquv::pool pool(pquv_pool_create(conninfo, 4, nullptr));
+//     pquv::result r = co_await pool.query("SELECT name FROM users WHERE id = $1", int64_t{42});
+//     if (r.ok())
+//         std::string_view name = r.get<std::string_view>(0, 0).value_or("");
+//
+// The awaitable embeds its pg_query_t and parameter buffers, and it lives in
+// the awaiting coroutine's frame, so queueing a query allocates nothing.
+// Parameter types map to OIDs at compile time and are sent in binary, and
+// results come back in binary so the typed getters below apply. Strings and
+// bytea are borrowed, not copied: they must stay alive until the co_await
+// completes, which temporaries in the co_await expression do.
+//
+// The coroutine resumes on the loop thread once pquv has released the query,
+// also when it is discarded (see pquv_query_status for the reasons). It runs
+// inside the release callback until its next suspension, so it may queue
+// more queries or shut the context or pool down, but not destroy them. Bring
+// your own task type; any coroutine can await these.
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "pquv.h"
+
+namespace pquv
+{
+
+// Binary bytea parameter
+struct bytea
+{
+    const void *data;
+    std::size_t size;
+};
+
+// Owns the final PGresult of an awaited query
+class result
+{
+  public:
+    result() = default;
+    result(PGresult *res, pquv_status_t status) : res_(res), status_(status) {}
+    result(const result &) = delete;
+    result &operator=(const result &) = delete;
+    result(result &&other) noexcept : res_(other.res_), status_(other.status_) { other.res_ = nullptr; }
+    result &operator=(result &&other) noexcept
+    {
+        if (this != &other)
+        {
+            PQclear(res_);
+            res_ = other.res_;
+            status_ = other.status_;
+            other.res_ = nullptr;
+        }
+        return *this;
+    }
+    ~result() { PQclear(res_); }
+
+    // The query reached the server and succeeded
+    bool ok() const
+    {
+        if (status_ != PQUV_STATUS_OK || !res_)
+            return false;
+
+        ExecStatusType s = PQresultStatus(res_);
+        return s == PGRES_TUPLES_OK || s == PGRES_COMMAND_OK;
+    }
+
+    pquv_status_t status() const { return status_; }
+    const char *error() const { return res_ ? PQresultErrorMessage(res_) : ""; }
+    int rows() const { return res_ ? PQntuples(res_) : 0; }
+    int columns() const { return res_ ? PQnfields(res_) : 0; }
+    PGresult *get() const { return res_; }
+
+    // Hand the PGresult over to the caller, who must PQclear it
+    PGresult *release()
+    {
+        PGresult *res = res_;
+        res_ = nullptr;
+        return res;
+    }
+
+    // Decode a binary value. Empty for NULL and for values that are not of
+    // the requested type. std::string_view returns the raw bytes, which is
+    // the value itself for text, varchar and bytea.
+    template <typename T>
+    std::optional<T> get(int row, int col) const
+    {
+        if (!res_ || row >= PQntuples(res_) || col >= PQnfields(res_) || PQgetisnull(res_, row, col))
+            return std::nullopt;
+
+        if constexpr (std::is_same_v<T, std::string_view>)
+        {
+            return std::string_view(PQgetvalue(res_, row, col), (std::size_t)PQgetlength(res_, row, col));
+        }
+        else if constexpr (std::is_same_v<T, std::string>)
+        {
+            return std::string(PQgetvalue(res_, row, col), (std::size_t)PQgetlength(res_, row, col));
+        }
+        else if constexpr (std::is_same_v<T, bool>)
+        {
+            if (PQfformat(res_, col) != 1 || PQgetlength(res_, row, col) != 1)
+                return std::nullopt;
+            return *PQgetvalue(res_, row, col) != 0;
+        }
+        else
+        {
+            T out{};
+            int rc;
+            if constexpr (std::is_same_v<T, std::int32_t>)
+                rc = pquv_get_int4(res_, row, col, &out);
+            else if constexpr (std::is_same_v<T, std::int64_t>)
+                rc = pquv_get_int8(res_, row, col, &out);
+            else if constexpr (std::is_same_v<T, double>)
+                rc = pquv_get_float8(res_, row, col, &out);
+            else
+                static_assert(sizeof(T) == 0, "unsupported result type");
+
+            if (rc != 0)
+                return std::nullopt;
+            return out;
+        }
+    }
+
+  private:
+    PGresult *res_ = nullptr;
+    pquv_status_t status_ = PQUV_STATUS_ERROR;
+};
+
+namespace detail
+{
+
+// One bound parameter: its OID, format and the bytes libpq sends. Fixed-width
+// values are encoded into buf, everything else points at the argument.
+struct slot
+{
+    char buf[8];
+};
+
+template <typename T>
+struct param
+{
+    static_assert(sizeof(T) == 0, "unsupported parameter type");
+};
+
+template <>
+struct param<std::int32_t>
+{
+    static Oid bind(std::int32_t v, slot &s, const char *&value, int &len, int &format)
+    {
+        pquv_put_int4(s.buf, v);
+        value = s.buf;
+        len = 4;
+        format = 1;
+        return PQUV_INT4OID;
+    }
+};
+
+template <>
+struct param<std::int64_t>
+{
+    static Oid bind(std::int64_t v, slot &s, const char *&value, int &len, int &format)
+    {
+        pquv_put_int8(s.buf, v);
+        value = s.buf;
+        len = 8;
+        format = 1;
+        return PQUV_INT8OID;
+    }
+};
+
+template <>
+struct param<double>
+{
+    static Oid bind(double v, slot &s, const char *&value, int &len, int &format)
+    {
+        pquv_put_float8(s.buf, v);
+        value = s.buf;
+        len = 8;
+        format = 1;
+        return PQUV_FLOAT8OID;
+    }
+};
+
+template <>
+struct param<bool>
+{
+    static Oid bind(bool v, slot &s, const char *&value, int &len, int &format)
+    {
+        s.buf[0] = v ? 1 : 0;
+        value = s.buf;
+        len = 1;
+        format = 1;
+        return PQUV_BOOLOID;
+    }
+};
+
+// Text is binary-compatible with its wire format, so no terminator is needed
+template <>
+struct param<std::string_view>
+{
+    static Oid bind(std::string_view v, slot &, const char *&value, int &len, int &format)
+    {
+        value = v.data();
+        len = (int)v.size();
+        format = 1;
+        return PQUV_TEXTOID;
+    }
+};
+
+template <>
+struct param<bytea>
+{
+    static Oid bind(bytea v, slot &, const char *&value, int &len, int &format)
+    {
+        value = static_cast<const char *>(v.data);
+        len = (int)v.size;
+        format = 1;
+        return PQUV_BYTEAOID;
+    }
+};
+
+template <>
+struct param<std::nullptr_t>
+{
+    static Oid bind(std::nullptr_t, slot &, const char *&value, int &len, int &format)
+    {
+        value = nullptr;
+        len = 0;
+        format = 0;
+        return 0;
+    }
+};
+
+template <typename T>
+struct param<std::optional<T>>
+{
+    static Oid bind(const std::optional<T> &v, slot &s, const char *&value, int &len, int &format)
+    {
+        if (v)
+            return param<T>::bind(*v, s, value, len, format);
+
+        // A NULL keeps the type of its non-NULL values
+        slot unused;
+        const char *ignored;
+        Oid oid = param<T>::bind(T{}, unused, ignored, len, format);
+        value = nullptr;
+        len = 0;
+        return oid;
+    }
+};
+
+// Map an argument type onto the param specialization it binds as. Other
+// integer widths widen to int4 or int8, strings bind as text.
+template <typename T>
+using param_type_t = std::conditional_t<
+    std::is_same_v<T, bool>,
+    bool,
+    std::conditional_t<
+        std::is_integral_v<T>,
+        std::conditional_t<(sizeof(T) <= 4 && std::is_signed_v<T>) || sizeof(T) < 4, std::int32_t, std::int64_t>,
+        std::conditional_t<std::is_floating_point_v<T>,
+                           double,
+                           std::conditional_t<std::is_convertible_v<const T &, std::string_view> &&
+                                                  !std::is_same_v<T, std::nullptr_t>,
+                                              std::string_view,
+                                              T>>>>;
+
+template <typename T>
+struct is_optional : std::false_type
+{
+};
+
+template <typename T>
+struct is_optional<std::optional<T>> : std::true_type
+{
+};
+
+template <typename T>
+Oid bind_param(const T &v, slot &s, const char *&value, int &len, int &format)
+{
+    using D = std::decay_t<T>;
+    if constexpr (std::is_same_v<D, std::nullptr_t> || std::is_same_v<D, bytea>)
+    {
+        return param<D>::bind(v, s, value, len, format);
+    }
+    else if constexpr (is_optional<D>::value)
+    {
+        using V = param_type_t<typename D::value_type>;
+        return param<std::optional<V>>::bind(v ? std::optional<V>(static_cast<V>(*v)) : std::nullopt, s, value,
+                                             len, format);
+    }
+    else
+    {
+        return param<param_type_t<D>>::bind(static_cast<param_type_t<D>>(v), s, value, len, format);
+    }
+}
+
+// Awaitable query. Not movable: libpq and pquv hold pointers into it, and
+// it must stay where the co_await expression created it.
+template <typename Target, std::size_t N>
+class query_op
+{
+  public:
+    template <typename... Args>
+    query_op(Target target, const char *sql, int flags, const Args &...args) : target_(target), flags_(flags)
+    {
+        query_.sql = const_cast<char *>(sql);
+        query_.param_count = (int)N;
+        query_.result_format = 1;
+        query_.result_cb = on_result;
+        query_.release_cb = on_release;
+        query_.data = this;
+        if constexpr (N > 0)
+        {
+            std::size_t i = 0;
+            ((types_[i] = detail::bind_param(args, slots_[i], values_[i], lengths_[i], formats_[i]), i++), ...);
+            query_.params = const_cast<char **>(values_);
+            query_.param_types = types_;
+            query_.param_lengths = lengths_;
+            query_.param_formats = formats_;
+        }
+    }
+
+    query_op(const query_op &) = delete;
+    query_op &operator=(const query_op &) = delete;
+
+    bool await_ready() const noexcept { return false; }
+
+    // Resume right away when the query could not be queued. A query that
+    // fails while being queued has already resumed the waiter, so this must
+    // not be touched once submit returns.
+    bool await_suspend(std::coroutine_handle<> waiter) noexcept
+    {
+        waiter_ = waiter;
+        query_.flags = flags_;
+        return submit(target_, &query_) == 0;
+    }
+
+    result await_resume() noexcept { return result(std::exchange(res_, nullptr), status_); }
+
+    ~query_op() { PQclear(res_); }
+
+  private:
+    static int submit(pquv_pool_t *pool, pg_query_t *query) { return pquv_pool_queue_query(pool, query); }
+    static int submit(pg_async_t *pg, pg_query_t *query) { return pquv_queue_query(pg, query); }
+
+    // Kept until pquv lets go of the node, a later result replaces it
+    static void on_result(pg_async_t *pg, PGresult *, void *data)
+    {
+        query_op *op = static_cast<query_op *>(data);
+        PQclear(op->res_);
+        op->res_ = pquv_keep_result(pg);
+        op->status_ = pquv_query_status(pg);
+    }
+
+    static void on_release(pg_query_t *query)
+    {
+        static_cast<query_op *>(query->data)->waiter_.resume();
+    }
+
+    Target target_;
+    int flags_;
+    pg_query_t query_{};
+    std::coroutine_handle<> waiter_;
+    PGresult *res_ = nullptr;
+    pquv_status_t status_ = PQUV_STATUS_ERROR;
+    slot slots_[N > 0 ? N : 1];
+    const char *values_[N > 0 ? N : 1];
+    int lengths_[N > 0 ? N : 1];
+    int formats_[N > 0 ? N : 1];
+    Oid types_[N > 0 ? N : 1];
+};
+
+} // namespace detail
+
+// Non-owning handle to a pooled set of connections
+class pool
+{
+  public:
+    explicit pool(pquv_pool_t *pool) : pool_(pool) {}
+
+    template <typename... Args>
+    detail::query_op<pquv_pool_t *, sizeof...(Args)> query(const char *sql, const Args &...args) const
+    {
+        return {pool_, sql, 0, args...};
+    }
+
+    // May go to a replica, see pquv_pool_queue_read
+    template <typename... Args>
+    detail::query_op<pquv_pool_t *, sizeof...(Args)> query_read(const char *sql, const Args &...args) const
+    {
+        return {pool_, sql, PQUV_QUERY_READ_ONLY, args...};
+    }
+
+    // Resent after a lost connection, see pquv_queue_idempotent
+    template <typename... Args>
+    detail::query_op<pquv_pool_t *, sizeof...(Args)> query_idempotent(const char *sql, const Args &...args) const
+    {
+        return {pool_, sql, PQUV_QUERY_IDEMPOTENT, args...};
+    }
+
+    pquv_pool_t *get() const { return pool_; }
+
+  private:
+    pquv_pool_t *pool_;
+};
+
+// Non-owning handle to a single context. Queries only start once it is
+// executing, so use a persistent context or call pquv_execute.
+class connection
+{
+  public:
+    explicit connection(pg_async_t *pg) : pg_(pg) {}
+
+    template <typename... Args>
+    detail::query_op<pg_async_t *, sizeof...(Args)> query(const char *sql, const Args &...args) const
+    {
+        return {pg_, sql, 0, args...};
+    }
+
+    template <typename... Args>
+    detail::query_op<pg_async_t *, sizeof...(Args)> query_idempotent(const char *sql, const Args &...args) const
+    {
+        return {pg_, sql, PQUV_QUERY_IDEMPOTENT, args...};
+    }
+
+    pg_async_t *get() const { return pg_; }
+
+  private:
+    pg_async_t *pg_;
+};
+
+} // namespace pquv
+
+#endif